@@ -0,0 +1,140 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include "camera_path.h"
+#include "image.h"
+#include "objects.h"
+#include "renderer.h"
+#include "threadpool.h"
+
+struct AnimationSettings
+{
+    size_t width = 800, height = 500;
+    int spp = 10;
+    float fps = 24;
+    int tileSize = 32;
+    int framesInFlight = 3;      // frames being traced or written at the same time
+    std::string stem = "frame";  // frames go to <stem>_0000.ppm, <stem>_0001.ppm, ...
+};
+
+// Renders every frame of a camera path in one go with the scene loaded once.
+// Tiles of all admitted frames share one queue on persistent workers, so cores
+// that run out of tiles at the end of a frame go straight on to the next one,
+// and finished frames are encoded and written by a separate thread while
+// tracing continues. At most framesInFlight images are alive at once.
+class AnimationRenderer
+{
+public:
+    AnimationRenderer(const Object& world, const CameraPath& path, AnimationSettings settings, int threads,
+        const LightBVH* lights = nullptr)
+        : world(world), path(path), settings(settings), threads(std::max(1, threads)), lights(lights) {}
+
+    int frameCount() const noexcept
+    {
+        return int(path.duration() * settings.fps) + 1;
+    }
+
+    std::string frameName(int index) const
+    {
+        char number[16];
+        std::snprintf(number, sizeof(number), "_%04d.ppm", index);
+        return settings.stem + number;
+    }
+
+    // returns the number of frames written
+    int render()
+    {
+        int frames = frameCount();
+        float aspect = float(settings.width) / float(settings.height);
+        ThreadPool pool;
+        pool.start(threads, true);
+        std::thread writer([this, frames]() { writeFrames(frames); });
+
+        for (int f = 0; f < frames; f++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                slotFree.wait(lock, [this]() { return inFlight < settings.framesInFlight; });
+                inFlight++;
+            }
+            auto frame = std::make_shared<Frame>(f, path.at(f / settings.fps, aspect), settings.width, settings.height);
+            int w = int(settings.width), h = int(settings.height), tile = settings.tileSize;
+            frame->remaining = ((w + tile - 1) / tile) * ((h + tile - 1) / tile);
+            for (int j = 0; j < h; j += tile) {
+                for (int i = 0; i < w; i += tile) {
+                    pool.addTask([this, frame, i, j, w, h, tile]() {
+                        renderTile(frame->img, frame->camera, world, settings.spp,
+                            i, std::min(i + tile, w), j, std::min(j + tile, h), lights);
+                        if (frame->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                            frameTraced(frame);
+                    });
+                }
+            }
+        }
+
+        pool.close();
+        writer.join();
+        return frames;
+    }
+
+private:
+    struct Frame
+    {
+        Frame(int index, const Camera& camera, size_t width, size_t height)
+            : index(index), camera(camera), img(width, height) {}
+
+        int index;
+        Camera camera;
+        Image img;
+        std::atomic<int> remaining{ 0 };
+    };
+
+    void frameTraced(const std::shared_ptr<Frame>& frame)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            traced.push(frame);
+        }
+        frameReady.notify_one();
+    }
+
+    void writeFrames(int frames)
+    {
+        for (int n = 0; n < frames; n++) {
+            std::shared_ptr<Frame> frame;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                frameReady.wait(lock, [this]() { return !traced.empty(); });
+                frame = traced.front();
+                traced.pop();
+            }
+            writeImage(std::ofstream(frameName(frame->index)), frame->img);
+            std::cerr << "frame " << frame->index + 1 << "/" << frames << " written" << std::endl;
+            frame.reset();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                inFlight--;
+            }
+            slotFree.notify_one();
+        }
+    }
+
+    const Object& world;
+    const CameraPath& path;
+    AnimationSettings settings;
+    int threads;
+    const LightBVH* lights;
+
+    std::mutex mutex;
+    std::condition_variable slotFree, frameReady;
+    int inFlight = 0;
+    std::queue<std::shared_ptr<Frame>> traced;
+};
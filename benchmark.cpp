@@ -0,0 +1,416 @@
+// Fixed-scene benchmark. Renders every standard scene at a range of thread
+// counts and prints the results as JSON, e.g.
+//   benchmark --width 400 --height 250 --spp 8 --threads 1,2,4,8 --out bench.json
+// --bvh wide uses the quantised four-wide BVH instead of the binary one,
+// --bvh lazy the BVH built on first hit (most of it lands in the first run).
+// Before timing a scene, rays are checked to hit the same with the BVH as
+// without it. With --kernels it instead times the vector kernels on
+// ScalarVec3 against the SIMD Vec3.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include "vec3.h"
+#include "vec3_scalar.h"
+#include "ray.h"
+#include "image.h"
+#include "camera.h"
+#include "random.h"
+#include "materials.h"
+#include "objects.h"
+#include "threadpool.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "wide_bvh.h"
+#include "lazy_bvh.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+constexpr unsigned BenchmarkSeed = 1234;
+constexpr int TaskBlockSize = 32;
+
+static size_t peakMemoryBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return pmc.PeakWorkingSetSize;
+    return 0;
+#else
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return size_t(usage.ru_maxrss);
+#else
+    return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+static double secondsSince(Clock::time_point start)
+{
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct BenchmarkScene
+{
+    string name;
+    function<ObjectGroup()> build;
+    Vec3 lookfrom, lookat;
+    float aperture;
+};
+
+struct RunResult
+{
+    int threads;
+    double seconds;
+    size_t primary, secondary;
+};
+
+static RunResult renderWithThreads(const Object& world, const Camera& camera, Image& img, int spp, int threads)
+{
+    ThreadPool tp;
+    atomic<size_t> primary{ 0 }, secondary{ 0 };
+    for (int j = 0; j < int(img.height); j += TaskBlockSize) {
+        for (int i = 0; i < int(img.width); i += TaskBlockSize) {
+            tp.addTask([&, i, j]() {
+                // seeded per tile, so a run draws the same numbers whichever
+                // worker takes the tile
+                seed_sample(BenchmarkSeed, unsigned(i), unsigned(j), 0);
+                RayCounter before = rayCounter;
+                renderTile(img, camera, world, spp, i, min(i + TaskBlockSize, int(img.width)),
+                    j, min(j + TaskBlockSize, int(img.height)));
+                primary += rayCounter.primary - before.primary;
+                secondary += rayCounter.secondary - before.secondary;
+            });
+        }
+    }
+#ifdef RAYTRACER_INSTRUMENT
+    Instrumentation::instance().reset(img.width, img.height);
+#endif
+    auto start = Clock::now();
+    tp.start(threads);
+    tp.join();
+    return RunResult{ threads, secondsSince(start), primary, secondary };
+}
+
+// Traces rays through the acceleration structure and through the plain
+// object list and throws if they disagree on any hit. Besides random rays
+// this sends rays along each axis, whose other two direction components are
+// exactly 0 and so give infinite 1 / direction in the slab tests.
+static size_t checkSameHits(const ObjectGroup& list, const Object& world)
+{
+    AABB box;
+    if (!list.bounding_box(box)) return 0;
+    Vec3 lo = box.min(), extent = box.max() - box.min();
+    auto inside = [&]() {
+        return lo + Vec3(float(random_double()), float(random_double()), float(random_double())) * extent;
+    };
+    vector<Ray> rays;
+    for (int i = 0; i < 128; i++)
+        rays.emplace_back(inside(), random_in_unit_sphere());
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < 32; i++) {
+            Vec3 dir(0, 0, 0);
+            dir[a] = i % 2 ? 1.0f : -1.0f;
+            rays.emplace_back(inside(), dir);
+        }
+    }
+    for (auto& r : rays) {
+        auto expected = list.hit(r, 0.001f, numeric_limits<float>::max());
+        auto got = world.hit(r, 0.001f, numeric_limits<float>::max());
+        if (expected.has_value() != got.has_value()
+            || (expected && fabs(expected->t - got->t) > 1e-4f * max(1.0f, expected->t))) {
+            ostringstream message;
+            message << "BVH disagrees with the object list for the ray from " << r.origin()
+                << " along " << r.direction();
+            throw runtime_error(message.str());
+        }
+    }
+    return rays.size();
+}
+
+static vector<int> parseThreadList(const string& list)
+{
+    vector<int> ret;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ','))
+        ret.push_back(max(1, stoi(item)));
+    return ret;
+}
+
+// Vector kernels, written once against the common Vec3/ScalarVec3 interface.
+// Each runs over the same random data and returns a checksum so the work
+// can't be optimised away.
+template<class V>
+struct KernelData
+{
+    vector<V> a, b, lo, hi;
+    vector<V> origin, inv; // rays aimed close to box i, about half of them hitting
+
+    explicit KernelData(size_t n)
+    {
+        seed_random(BenchmarkSeed);
+        auto rnd = [] { return V(float(random_double() * 2 - 1), float(random_double() * 2 - 1), float(random_double() * 2 - 1)); };
+        for (size_t i = 0; i < n; i++) {
+            a.push_back(rnd());
+            b.push_back(rnd());
+            V c = rnd(), d = rnd();
+            lo.push_back(vmin(c, d));
+            hi.push_back(vmax(c, d));
+            origin.push_back(a.back() * 4.0f);
+            V target = 0.5f * (lo.back() + hi.back()) + 0.5f * b.back();
+            inv.push_back(V(1, 1, 1) / (target - origin.back()));
+        }
+    }
+};
+
+template<class V>
+static float kernelDot(const KernelData<V>& d)
+{
+    float sum = 0;
+    for (size_t i = 0; i < d.a.size(); i++) sum += dot(d.a[i], d.b[i]);
+    return sum;
+}
+
+template<class V>
+static float kernelCross(const KernelData<V>& d)
+{
+    V sum;
+    for (size_t i = 0; i < d.a.size(); i++) sum += cross(d.a[i], d.b[i]);
+    return sum.x() + sum.y() + sum.z();
+}
+
+template<class V>
+static float kernelNormalize(const KernelData<V>& d)
+{
+    V sum;
+    for (size_t i = 0; i < d.a.size(); i++) sum += unit_vector(d.a[i]);
+    return sum.x() + sum.y() + sum.z();
+}
+
+template<class V>
+static float kernelSlabs(const KernelData<V>& d)
+{
+    // every box against one ray, like a node visit during traversal
+    V origin = d.a[0] * 4.0f, inv = V(1, 1, 1) / d.b[0];
+    int hits = 0;
+    for (size_t i = 0; i < d.lo.size(); i++) hits += hit_slabs(d.lo[i], d.hi[i], origin, inv, 0.001f, 1e30f);
+    return float(hits);
+}
+
+template<class V>
+static float kernelSlabsNear(const KernelData<V>& d)
+{
+    // each box against a ray aimed near it, like the nodes a traversal
+    // actually reaches, where testing one axis seldom settles it
+    int hits = 0;
+    for (size_t i = 0; i < d.lo.size(); i++) hits += hit_slabs(d.lo[i], d.hi[i], d.origin[i], d.inv[i], 0.001f, 1e30f);
+    return float(hits);
+}
+
+template<class V>
+static float kernelSphere(const KernelData<V>& d)
+{
+    // the quadratic from Sphere::hit, centres in a and directions in b
+    V origin(0, 0, -3);
+    float sum = 0;
+    for (size_t i = 0; i < d.a.size(); i++) {
+        V oc = origin - d.a[i];
+        float a = dot(d.b[i], d.b[i]);
+        float b = dot(oc, d.b[i]);
+        float c = dot(oc, oc) - 0.25f;
+        float discriminant = b * b - a * c;
+        if (discriminant > 0) sum += (-b - std::sqrt(discriminant)) / a;
+    }
+    return sum;
+}
+
+// nanoseconds per element, best of a few runs
+template<class V>
+static double timeKernel(float (*kernel)(const KernelData<V>&), const KernelData<V>& data, float& checksum)
+{
+    constexpr int Reps = 200;
+    double best = 1e30;
+    for (int run = 0; run < 5; run++) {
+        auto start = Clock::now();
+        for (int r = 0; r < Reps; r++) checksum += kernel(data);
+        best = min(best, secondsSince(start));
+    }
+    return best * 1e9 / (double(Reps) * data.a.size());
+}
+
+static string runKernels()
+{
+    constexpr size_t N = 4096;
+    KernelData<ScalarVec3> scalarData(N);
+    KernelData<Vec3> simdData(N);
+    struct Kernel
+    {
+        const char* name;
+        float (*scalar)(const KernelData<ScalarVec3>&);
+        float (*simd)(const KernelData<Vec3>&);
+    };
+    Kernel kernels[] = {
+        { "dot", kernelDot<ScalarVec3>, kernelDot<Vec3> },
+        { "cross", kernelCross<ScalarVec3>, kernelCross<Vec3> },
+        { "normalize", kernelNormalize<ScalarVec3>, kernelNormalize<Vec3> },
+        { "aabb_slabs", kernelSlabs<ScalarVec3>, kernelSlabs<Vec3> },
+        { "aabb_slabs_near", kernelSlabsNear<ScalarVec3>, kernelSlabsNear<Vec3> },
+        { "sphere", kernelSphere<ScalarVec3>, kernelSphere<Vec3> },
+    };
+
+    ostringstream json;
+#ifdef RAYTRACER_SIMD
+    json << "{\n  \"simd\": true,\n  \"kernels\": [";
+#else
+    json << "{\n  \"simd\": false,\n  \"kernels\": [";
+#endif
+    float checksum = 0;
+    for (size_t k = 0; k < size(kernels); k++) {
+        double scalarNs = timeKernel(kernels[k].scalar, scalarData, checksum);
+        double simdNs = timeKernel(kernels[k].simd, simdData, checksum);
+        json << (k ? "," : "") << "\n    { \"name\": \"" << kernels[k].name << "\""
+            << ", \"scalar_ns\": " << scalarNs << ", \"simd_ns\": " << simdNs
+            << ", \"speedup\": " << scalarNs / simdNs << " }";
+    }
+    json << "\n  ],\n  \"checksum\": " << checksum << "\n}\n";
+    return json.str();
+}
+
+int main(int argc, char** argv)
+{
+    int width = 400, height = 250, spp = 8;
+    vector<int> threadCounts;
+    string outPath;
+    bool kernels = false;
+    string bvhKind = "binary";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        auto next = [&]() -> string {
+            if (i + 1 >= argc) throw invalid_argument("missing value for " + arg);
+            return argv[++i];
+        };
+        if (arg == "--width") width = stoi(next());
+        else if (arg == "--height") height = stoi(next());
+        else if (arg == "--spp") spp = stoi(next());
+        else if (arg == "--threads") threadCounts = parseThreadList(next());
+        else if (arg == "--out") outPath = next();
+        else if (arg == "--kernels") kernels = true;
+        else if (arg == "--bvh") {
+            bvhKind = next();
+            if (bvhKind != "binary" && bvhKind != "wide" && bvhKind != "lazy")
+                throw invalid_argument("--bvh expects binary, wide or lazy");
+        }
+        else {
+            cerr << "unknown argument " << arg << endl;
+            return 1;
+        }
+    }
+    if (kernels) {
+        string json = runKernels();
+        if (outPath.empty())
+            cout << json;
+        else
+            ofstream(outPath) << json;
+        return 0;
+    }
+    if (threadCounts.empty()) {
+        int hw = max(1u, thread::hardware_concurrency());
+        for (int t = 1; t < hw; t *= 2) threadCounts.push_back(t);
+        threadCounts.push_back(hw);
+    }
+
+    vector<BenchmarkScene> scenes = {
+        { "random", [] { return generateRandomScene(); }, { 13, 2, 3 }, { 13, 2, 3 }, 0.1f },
+        { "dense", [] { return generateDenseScene(); }, { 0, 6, 14 }, { 0, 6, 14 }, 0.0f },
+        { "mesh", [] { return generateMeshScene(); }, { 0, 5, 10 }, { 0, 5, 10 }, 0.0f },
+        { "lights", [] { return generateLightScene(); }, { 0, 2, 8 }, { 0, 1, 13 }, 0.0f },
+    };
+
+    ostringstream json;
+    json << "{\n  \"width\": " << width << ", \"height\": " << height << ", \"spp\": " << spp
+        << ", \"seed\": " << BenchmarkSeed << ", \"bvh\": \"" << bvhKind << "\",\n  \"scenes\": [";
+    for (size_t s = 0; s < scenes.size(); s++) {
+        auto& scene = scenes[s];
+        cerr << "benchmarking " << scene.name << "..." << endl;
+
+        seed_random(BenchmarkSeed);
+        ObjectGroup list = scene.build();
+        auto buildStart = Clock::now();
+        shared_ptr<Object> world;
+        size_t bvhBytes = 0;
+        if (bvhKind == "wide") {
+            auto bvh = list.to_wide_bvh();
+            bvhBytes = bvh->memoryBytes();
+            world = bvh;
+        }
+        else if (bvhKind == "lazy") {
+            world = list.to_lazy_bvh();
+        }
+        else {
+            world = list.to_bvh_node();
+        }
+        double buildSeconds = secondsSince(buildStart);
+        cerr << "  " << checkSameHits(list, *world) << " rays hit the same as without the BVH" << endl;
+
+        Camera camera{ scene.lookfrom, scene.lookat, { 0, 1, 0 }, 40, float(width) / float(height),
+            scene.aperture, (scene.lookfrom).length() };
+        Image img{ size_t(width), size_t(height) };
+
+        json << (s ? "," : "") << "\n    {\n      \"name\": \"" << scene.name << "\",\n"
+            << "      \"bvh_build_ms\": " << buildSeconds * 1000 << ",\n";
+        if (bvhKind == "wide")
+            json << "      \"bvh_bytes\": " << bvhBytes << ",\n";
+        json
+            << "      \"runs\": [";
+        double baseline = 0;
+        for (size_t t = 0; t < threadCounts.size(); t++) {
+            RunResult run = renderWithThreads(*world, camera, img, spp, threadCounts[t]);
+            if (t == 0) baseline = run.seconds;
+            json << (t ? "," : "") << "\n        { \"threads\": " << run.threads
+                << ", \"seconds\": " << run.seconds
+                << ", \"primary_rays_per_sec\": " << run.primary / run.seconds
+                << ", \"secondary_rays_per_sec\": " << run.secondary / run.seconds
+                << ", \"samples_per_sec\": " << double(width) * height * spp / run.seconds
+                << ", \"speedup\": " << baseline / run.seconds;
+#ifdef RAYTRACER_INSTRUMENT
+            auto totals = Instrumentation::instance().aggregate();
+            json << ", \"bvh_nodes_visited\": " << totals.bvhNodesVisited
+                << ", \"primitive_tests\": " << totals.primitiveTests
+                << ", \"mean_bounces\": " << totals.meanBounces();
+#endif
+            json << " }";
+        }
+        json << "\n      ]\n    }";
+#ifdef RAYTRACER_INSTRUMENT
+        Instrumentation::instance().writeHeatmap(ofstream(scene.name + "_heatmap.ppm"));
+        Instrumentation::instance().writeTrace(ofstream(scene.name + "_trace.json"));
+#endif
+    }
+    // the OS only keeps a high-water mark for the whole process, so this is
+    // the largest scene's
+    json << "\n  ],\n  \"peak_memory_bytes\": " << peakMemoryBytes() << "\n}\n";
+
+    if (outPath.empty())
+        cout << json.str();
+    else
+        ofstream(outPath) << json.str();
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include "camera.h"
+#include "film.h"
+#include "objects.h"
+#include "renderer.h"
+#include "threadpool.h"
+
+// Renders into a Film until a wall-clock deadline instead of to a fixed sample
+// count. A coarse pass, one sample per CoarseScale x CoarseScale block, always
+// runs to the end and goes into the film's history (as reprojection does), so
+// there is a whole picture however short the budget. Then a pass gives every
+// pixel one sample, and the rest of the time is spent in rounds that hand
+// tiles samples in proportion to their remaining noise, using per-tile cost
+// measured in the previous rounds. Tiles stop between passes once the
+// deadline is reached; pixels that got no fresh sample keep the coarse one.
+class BudgetRenderer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    BudgetRenderer(const Object& world, const Camera& camera, Film& film, int threads,
+        const LightBVH* lights = nullptr, int tileSize = 32)
+        : world(world), camera(camera), film(film), threads(std::max(1, threads)), lights(lights)
+    {
+        for (int j = 0; j < int(film.height); j += tileSize)
+            for (int i = 0; i < int(film.width); i += tileSize)
+                tiles.push_back(Tile{ i, std::min(i + tileSize, int(film.width)),
+                    j, std::min(j + tileSize, int(film.height)) });
+    }
+
+    // returns the number of rounds run after the first pass
+    int render(double seconds)
+    {
+        auto start = Clock::now();
+        deadline = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+
+        coarsePass();
+        for (auto& tile : tiles) tile.samples = 1;
+        runRound();
+
+        int rounds = 0;
+        while (Clock::now() < deadline) {
+            double remaining = std::chrono::duration<double>(deadline - Clock::now()).count();
+            // short rounds near the end keep the estimate honest; the first ones
+            // get a quarter of what is left so tile priorities can adapt
+            double roundSeconds = std::max(remaining / 4, std::min(remaining, 0.05));
+            if (!planRound(roundSeconds)) break;
+            runRound();
+            rounds++;
+        }
+
+        // the coarse picture only stands in where nothing was rendered
+        for (size_t idx = 0; idx < film.samples.size(); idx++)
+            if (film.samples[idx]) film.historyWeight[idx] = 0;
+        return rounds;
+    }
+
+    // side of the pixel blocks sharing a sample in the coarse pass
+    static constexpr int CoarseScale = 4;
+
+private:
+    struct Tile
+    {
+        int i_low, i_high, j_low, j_high;
+        int samples = 0;         // samples per pixel to add this round
+        double secondsPerPass = 0; // measured cost of one sample over the whole tile
+    };
+
+    // one sample per block over the whole frame, deadline or not
+    void coarsePass()
+    {
+        Film coarse{ (film.width + CoarseScale - 1) / CoarseScale, (film.height + CoarseScale - 1) / CoarseScale };
+        ThreadPool tp;
+        for (int j = 0; j < int(coarse.height); j += 8) {
+            tp.addTask([this, &coarse, j]() {
+                accumulateTile(coarse, camera, world, 1, 0, int(coarse.width), j, std::min(j + 8, int(coarse.height)),
+                    nullptr, lights);
+            });
+        }
+        tp.start(threads);
+        tp.join();
+        for (size_t y = 0; y < film.height; y++) {
+            for (size_t x = 0; x < film.width; x++) {
+                size_t idx = y * film.width + x;
+                film.history[idx] = coarse.average(x / CoarseScale, y / CoarseScale);
+                film.historyDepth[idx] = coarse.depth(x / CoarseScale, y / CoarseScale);
+                film.historyWeight[idx] = 1;
+            }
+        }
+    }
+
+    // Tiles the first pass didn't reach have no measured cost; they get one
+    // pass to measure it and are left out of the sharing out by noise.
+    bool planRound(double roundSeconds)
+    {
+        std::vector<double> error(tiles.size());
+        double totalError = 0;
+        for (size_t t = 0; t < tiles.size(); t++) {
+            auto& tile = tiles[t];
+            if (tile.secondsPerPass <= 0) continue;
+            double e = 0;
+            for (int j = tile.j_low; j < tile.j_high; j++)
+                for (int i = tile.i_low; i < tile.i_high; i++)
+                    e += film.varianceOfMean(i, j);
+            error[t] = e;
+            totalError += e;
+        }
+
+        // wall time is shared by all workers
+        double workSeconds = roundSeconds * threads;
+        bool any = false;
+        size_t measured = 0;
+        for (auto& tile : tiles) measured += tile.secondsPerPass > 0;
+        for (size_t t = 0; t < tiles.size(); t++) {
+            auto& tile = tiles[t];
+            if (tile.secondsPerPass <= 0) {
+                tile.samples = 1;
+                any = true;
+                continue;
+            }
+            double share = totalError > 0 ? error[t] / totalError : 1.0 / measured;
+            double passes = workSeconds * share / std::max(tile.secondsPerPass, 1e-7);
+            tile.samples = int(std::min(passes, 1024.0));
+            any |= tile.samples > 0;
+        }
+        return any;
+    }
+
+    void runRound()
+    {
+        ThreadPool tp;
+        for (auto& tile : tiles) {
+            if (tile.samples <= 0) continue;
+            tp.addTask([this, &tile]() {
+                auto start = Clock::now();
+                int done = 0;
+                for (; done < tile.samples; done++) {
+                    if (Clock::now() >= deadline) break;
+                    accumulateTile(film, camera, world, 1, tile.i_low, tile.i_high, tile.j_low, tile.j_high,
+                        nullptr, lights);
+                }
+                if (done > 0) {
+                    double perPass = std::chrono::duration<double>(Clock::now() - start).count() / done;
+                    // smooth so one unlucky pass doesn't starve a tile
+                    tile.secondsPerPass = tile.secondsPerPass > 0 ? 0.5 * (tile.secondsPerPass + perPass) : perPass;
+                }
+            });
+        }
+        tp.start(threads);
+        tp.join();
+    }
+
+    const Object& world;
+    const Camera& camera;
+    Film& film;
+    int threads;
+    const LightBVH* lights;
+    std::vector<Tile> tiles;
+    Clock::time_point deadline;
+};
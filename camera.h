@@ -30,12 +30,31 @@ public:
         vertical = 2 * half_height * focus_dist * v;
     }
 
+    // a pinhole camera (DepthOfField = false) skips sampling the lens
+    template<bool DepthOfField = true>
     Ray getRay(float s, float t) const noexcept {
+        if constexpr (!DepthOfField)
+            return Ray(origin, direction(s, t));
         Vec3 rd = lens_radius * random_in_unit_disk();
         Vec3 offset = u * rd.x() + v * rd.y();
-        return Ray(origin + offset,
-            lower_left_corner + s * horizontal + t * vertical
-            - origin - offset);
+        return Ray(origin + offset, direction(s, t) - offset);
+    }
+
+    // pinhole ray direction through (s, t), not normalised
+    Vec3 direction(float s, float t) const noexcept {
+        return fmadd(horizontal, Vec3(s, s, s), fmadd(vertical, Vec3(t, t, t), lower_left_corner - origin));
+    }
+
+    // inverse of direction(): where p lands on the image, false if it is
+    // behind the camera
+    bool project(const Vec3& p, float& s, float& t) const noexcept {
+        Vec3 d = p - origin;
+        float along = -dot(d, w);
+        if (along <= 0) return false;
+        Vec3 onPlane = origin + d * (focus_dist / along) - lower_left_corner;
+        s = dot(onPlane, horizontal) / horizontal.squared_length();
+        t = dot(onPlane, vertical) / vertical.squared_length();
+        return true;
     }
 
     Vec3 lookfrom, lookat, vup;
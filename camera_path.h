@@ -0,0 +1,83 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "vec3.h"
+#include "camera.h"
+
+// Camera keyframes for animations. A path file has one key per line:
+//   time  from.x from.y from.z  target.x target.y target.z  vfov  aperture  focus_dist
+// Times are in seconds and must increase. A focus_dist of 0 focuses on the
+// target. Lines starting with # are comments.
+struct CameraKey
+{
+    float time;
+    Vec3 from, target;
+    float vfov, aperture, focusDist;
+};
+
+class CameraPath
+{
+public:
+    static CameraPath load(const std::string& path)
+    {
+        std::ifstream file(path);
+        if (!file)
+            throw std::runtime_error("cannot open " + path);
+        CameraPath ret;
+        std::string line;
+        while (std::getline(file, line)) {
+            auto first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#')
+                continue;
+            std::istringstream ss(line);
+            CameraKey key;
+            if (!(ss >> key.time >> key.from >> key.target >> key.vfov >> key.aperture >> key.focusDist))
+                throw std::runtime_error("bad camera key in " + path + ": " + line);
+            if (!ret.keys.empty() && key.time <= ret.keys.back().time)
+                throw std::runtime_error("camera key times must increase in " + path);
+            ret.keys.push_back(key);
+        }
+        if (ret.keys.empty())
+            throw std::runtime_error("no camera keys in " + path);
+        return ret;
+    }
+
+    float duration() const noexcept { return keys.back().time - keys.front().time; }
+
+    // positions and targets follow a Catmull-Rom spline through the keys,
+    // lens settings are interpolated linearly
+    Camera at(float time, float aspect) const
+    {
+        time = std::clamp(time + keys.front().time, keys.front().time, keys.back().time);
+        size_t k = 0;
+        while (k + 2 < keys.size() && keys[k + 1].time < time) k++;
+        const CameraKey& k1 = keys[k];
+        const CameraKey& k2 = keys[std::min(k + 1, keys.size() - 1)];
+        const CameraKey& k0 = keys[k > 0 ? k - 1 : 0];
+        const CameraKey& k3 = keys[std::min(k + 2, keys.size() - 1)];
+        float s = k2.time > k1.time ? (time - k1.time) / (k2.time - k1.time) : 0.0f;
+
+        Vec3 from = catmullRom(k0.from, k1.from, k2.from, k3.from, s);
+        Vec3 target = catmullRom(k0.target, k1.target, k2.target, k3.target, s);
+        float vfov = k1.vfov + s * (k2.vfov - k1.vfov);
+        float aperture = k1.aperture + s * (k2.aperture - k1.aperture);
+        float focus = k1.focusDist + s * (k2.focusDist - k1.focusDist);
+        if (focus <= 0) focus = (target - from).length();
+        // the camera's "lookat" points from the target back to the eye
+        return Camera{ from, from - target, { 0, 1, 0 }, vfov, aspect, aperture, focus };
+    }
+
+    std::vector<CameraKey> keys;
+
+private:
+    static Vec3 catmullRom(const Vec3& p0, const Vec3& p1, const Vec3& p2, const Vec3& p3, float s)
+    {
+        float s2 = s * s, s3 = s2 * s;
+        return 0.5f * (2.0f * p1 + (p2 - p0) * s + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * s2
+            + (3.0f * p1 - p0 - 3.0f * p2 + p3) * s3);
+    }
+};
@@ -0,0 +1,542 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "camera.h"
+#include "image.h"
+#include "objects.h"
+#include "random.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "threadpool.h"
+#include "tile_cache.h"
+#include "wide_bvh.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <windows.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+using SocketHandle = SOCKET;
+constexpr SocketHandle InvalidSocket = INVALID_SOCKET;
+inline void closeSocket(SocketHandle s) { closesocket(s); }
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+using SocketHandle = int;
+constexpr SocketHandle InvalidSocket = -1;
+inline void closeSocket(SocketHandle s) { ::close(s); }
+#endif
+
+// Line-based connection over a local (Unix domain) socket.
+class LocalConnection
+{
+public:
+    explicit LocalConnection(SocketHandle s) : s(s) {}
+    LocalConnection(const LocalConnection&) = delete;
+    ~LocalConnection() { if (s != InvalidSocket) closeSocket(s); }
+
+    static std::unique_ptr<LocalConnection> connect(const std::string& path)
+    {
+        startup();
+        SocketHandle s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s == InvalidSocket)
+            throw std::runtime_error("cannot create socket");
+        sockaddr_un addr = address(path);
+        if (::connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            closeSocket(s);
+            throw std::runtime_error("cannot connect to " + path);
+        }
+        return std::make_unique<LocalConnection>(s);
+    }
+
+    // false once the other side has gone
+    bool readLine(std::string& line)
+    {
+        line.clear();
+        char c;
+        while (recv(s, &c, 1, 0) == 1) {
+            if (c == '\n') return true;
+            if (c != '\r') line += c;
+        }
+        return !line.empty();
+    }
+
+    bool writeLine(const std::string& line)
+    {
+        std::string data = line + "\n";
+        size_t sent = 0;
+        while (sent < data.size()) {
+            auto n = send(s, data.data() + sent, int(data.size() - sent), SendFlags);
+            if (n <= 0) return false;
+            sent += size_t(n);
+        }
+        return true;
+    }
+
+    static sockaddr_un address(const std::string& path)
+    {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            throw std::invalid_argument("socket path too long: " + path);
+        std::copy(path.begin(), path.end(), addr.sun_path);
+        return addr;
+    }
+
+    static void startup()
+    {
+#ifdef _WIN32
+        static bool started = [] { WSADATA data; return WSAStartup(MAKEWORD(2, 2), &data) == 0; }();
+        if (!started) throw std::runtime_error("cannot start winsock");
+#endif
+    }
+
+private:
+#ifdef MSG_NOSIGNAL
+    static constexpr int SendFlags = MSG_NOSIGNAL; // a client going away mustn't kill the daemon
+#else
+    static constexpr int SendFlags = 0;
+#endif
+    SocketHandle s;
+};
+
+struct RenderJob
+{
+    enum class State { Queued, Running, Done, Failed };
+
+    uint64_t id = 0;
+    int priority = 0;
+    std::string scene, output;
+    Vec3 from{ 13, 2, 3 }, target{ 0, 0, 0 };
+    float vfov = 20, aperture = 0, focusDist = 0;
+    size_t width = 400, height = 250;
+    int spp = 8;
+    unsigned seed = 0;
+    // part of the frame to write, from its top left corner; all of it if 0
+    size_t cropX = 0, cropY = 0, cropWidth = 0, cropHeight = 0;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    State state = State::Queued;
+    int tilesDone = 0, tiles = 0;
+    double seconds = 0;
+    std::string error;
+
+    Camera camera() const
+    {
+        float focus = focusDist > 0 ? focusDist : (target - from).length();
+        return Camera{ from, from - target, { 0, 1, 0 }, vfov, float(width) / float(height), aperture, focus };
+    }
+
+    void set(State s, const std::string& message = {})
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            state = s;
+            error = message;
+        }
+        changed.notify_all();
+    }
+};
+
+// Render server. Scenes are built on first use and kept with their BVH, keyed
+// by name; workers stay up between jobs. Each connection sends one request
+// line and gets answers back on the same connection:
+//   render scene=random width=400 height=250 spp=8 from=13,2,3 target=0,0,0
+//          vfov=20 aperture=0.1 focus=0 priority=1 seed=0 crop=0,0,100,50 out=/tmp/a.ppm
+//     -> queued <id>, started <id>, progress <id> <tiles done> <tiles>, done <id> <seconds>
+//   scenes   -> the scene names, then "end"
+//   shutdown -> bye, and the daemon exits once the queued jobs are done
+// Jobs run one at a time, highest priority first, then in arrival order.
+// With a cache directory, tiles go through a TileCache (tile_cache.h): jobs
+// repeating or cropping an earlier frame load its tiles, and jobs asking for
+// more samples than were cached render only the extra ones.
+class RenderDaemon
+{
+public:
+    static constexpr int TileSize = 32;
+
+    static constexpr size_t DefaultCacheBytes = size_t(1) << 30;
+
+    RenderDaemon(std::string path, int threads, const std::string& cacheDir = {}, size_t cacheBytes = DefaultCacheBytes)
+        : path(std::move(path)), threads(std::max(1, threads)), generators(namedScenes())
+    {
+        if (!cacheDir.empty())
+            cache = std::make_unique<TileCache>(cacheDir, cacheBytes);
+    }
+
+    void run()
+    {
+        LocalConnection::startup();
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == InvalidSocket)
+            throw std::runtime_error("cannot create socket");
+#ifdef _WIN32
+        DeleteFileA(path.c_str());
+#else
+        unlink(path.c_str());
+#endif
+        sockaddr_un addr = LocalConnection::address(path);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+            closeSocket(listener);
+            throw std::runtime_error("cannot listen on " + path);
+        }
+        std::cout << "Listening on " << path << " with " << threads << " workers" << std::endl;
+
+        pool.start(threads, true);
+        std::thread scheduler([this]() { schedule(); });
+        std::list<Client> clients;
+        while (!stopping) {
+            SocketHandle s = accept(listener, nullptr, nullptr);
+            if (s == InvalidSocket) break;
+            reap(clients);
+            auto& client = clients.emplace_back();
+            client.thread = std::thread([this, s, &client]() {
+                serve(std::make_unique<LocalConnection>(s));
+                client.finished = true;
+            });
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            if (!listenerClosed) closeSocket(listener);
+            listenerClosed = true;
+        }
+        jobAdded.notify_all();
+        scheduler.join();
+        for (auto& client : clients) client.thread.join();
+        pool.close();
+#ifdef _WIN32
+        DeleteFileA(path.c_str());
+#else
+        unlink(path.c_str());
+#endif
+    }
+
+private:
+    struct ByPriority
+    {
+        bool operator()(const std::shared_ptr<RenderJob>& a, const std::shared_ptr<RenderJob>& b) const
+        {
+            return a->priority != b->priority ? a->priority < b->priority : a->id > b->id;
+        }
+    };
+
+    // one connection's thread; the list node stays put, so it can set its flag
+    struct Client
+    {
+        std::thread thread;
+        std::atomic<bool> finished{ false };
+    };
+
+    // joins the threads of connections that are done, so they don't pile up
+    static void reap(std::list<Client>& clients)
+    {
+        for (auto it = clients.begin(); it != clients.end();) {
+            if (!it->finished) {
+                ++it;
+                continue;
+            }
+            it->thread.join();
+            it = clients.erase(it);
+        }
+    }
+
+    void serve(std::unique_ptr<LocalConnection> connection)
+    {
+        std::string line;
+        if (!connection->readLine(line)) return;
+        std::istringstream request(line);
+        std::string command;
+        request >> command;
+        try {
+            if (command == "render") {
+                auto job = parseJob(request);
+                enqueue(job);
+                connection->writeLine("queued " + std::to_string(job->id));
+                report(*connection, *job);
+            }
+            else if (command == "scenes") {
+                for (auto& [name, generate] : generators) connection->writeLine(name);
+                connection->writeLine("end");
+            }
+            else if (command == "shutdown") {
+                connection->writeLine("bye");
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stopping = true;
+                    // wakes the accept() in run(), which closes it on Linux
+                    if (!listenerClosed) {
+#ifdef _WIN32
+                        closesocket(listener);
+                        listenerClosed = true;
+#else
+                        shutdown(listener, SHUT_RDWR);
+#endif
+                    }
+                }
+                jobAdded.notify_all();
+            }
+            else {
+                connection->writeLine("error unknown command " + command);
+            }
+        }
+        catch (const std::exception& e) {
+            connection->writeLine(std::string("error ") + e.what());
+        }
+    }
+
+    std::shared_ptr<RenderJob> parseJob(std::istringstream& request)
+    {
+        auto job = std::make_shared<RenderJob>();
+        job->scene = "random";
+        std::string token;
+        while (request >> token) {
+            auto eq = token.find('=');
+            if (eq == std::string::npos) throw std::invalid_argument("expected key=value, got " + token);
+            std::string key = token.substr(0, eq), value = token.substr(eq + 1);
+            if (key == "scene") job->scene = value;
+            else if (key == "out") job->output = value;
+            else if (key == "width") job->width = std::stoul(value);
+            else if (key == "height") job->height = std::stoul(value);
+            else if (key == "spp") job->spp = std::stoi(value);
+            else if (key == "priority") job->priority = std::stoi(value);
+            else if (key == "vfov") job->vfov = std::stof(value);
+            else if (key == "aperture") job->aperture = std::stof(value);
+            else if (key == "focus") job->focusDist = std::stof(value);
+            else if (key == "from") job->from = parseVec3(value);
+            else if (key == "target") job->target = parseVec3(value);
+            else if (key == "seed") job->seed = unsigned(std::stoul(value));
+            else if (key == "crop") {
+                std::replace(value.begin(), value.end(), ',', ' ');
+                std::istringstream ss(value);
+                if (!(ss >> job->cropX >> job->cropY >> job->cropWidth >> job->cropHeight))
+                    throw std::invalid_argument("expected crop=x,y,width,height");
+            }
+            else throw std::invalid_argument("unknown key " + key);
+        }
+        if (job->output.empty()) throw std::invalid_argument("out= is required");
+        if (!generators.count(job->scene)) throw std::invalid_argument("unknown scene " + job->scene);
+        if (job->width == 0 || job->height == 0 || job->spp <= 0) throw std::invalid_argument("bad size or spp");
+        if (job->cropWidth == 0 || job->cropHeight == 0) {
+            job->cropX = job->cropY = 0;
+            job->cropWidth = job->width;
+            job->cropHeight = job->height;
+        }
+        if (job->cropX + job->cropWidth > job->width || job->cropY + job->cropHeight > job->height)
+            throw std::invalid_argument("crop outside the frame");
+        return job;
+    }
+
+    static Vec3 parseVec3(std::string value)
+    {
+        std::replace(value.begin(), value.end(), ',', ' ');
+        std::istringstream ss(value);
+        Vec3 v;
+        if (!(ss >> v)) throw std::invalid_argument("expected x,y,z, got " + value);
+        return v;
+    }
+
+    void enqueue(const std::shared_ptr<RenderJob>& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) throw std::runtime_error("shutting down");
+            job->id = ++lastId;
+            queue.push(job);
+        }
+        jobAdded.notify_one();
+    }
+
+    // streams the job's state to the client until it is finished
+    void report(LocalConnection& connection, RenderJob& job)
+    {
+        std::string id = std::to_string(job.id);
+        RenderJob::State seen = RenderJob::State::Queued;
+        int seenTiles = -1;
+        for (;;) {
+            std::unique_lock<std::mutex> lock(job.mutex);
+            job.changed.wait_for(lock, std::chrono::milliseconds(100),
+                [&]() { return job.state != seen || job.tilesDone != seenTiles; });
+            auto state = job.state;
+            int done = job.tilesDone, tiles = job.tiles;
+            lock.unlock();
+
+            bool ok = true;
+            if (state != seen && state == RenderJob::State::Running)
+                ok = connection.writeLine("started " + id);
+            if (state == RenderJob::State::Running && done != seenTiles)
+                ok = ok && connection.writeLine("progress " + id + " " + std::to_string(done) + " " + std::to_string(tiles));
+            if (state == RenderJob::State::Done) {
+                connection.writeLine("done " + id + " " + std::to_string(job.seconds));
+                return;
+            }
+            if (state == RenderJob::State::Failed) {
+                connection.writeLine("error " + id + " " + job.error);
+                return;
+            }
+            // a client that hangs up doesn't cancel its job
+            if (!ok) return;
+            seen = state;
+            seenTiles = done;
+        }
+    }
+
+    void schedule()
+    {
+        for (;;) {
+            std::shared_ptr<RenderJob> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobAdded.wait(lock, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                job = queue.top();
+                queue.pop();
+            }
+            try {
+                render(*job);
+            }
+            catch (const std::exception& e) {
+                job->set(RenderJob::State::Failed, e.what());
+            }
+        }
+    }
+
+    struct Scene
+    {
+        std::shared_ptr<WideBVH> bvh;
+        uint64_t hash;
+    };
+
+    const Scene& sceneFor(const std::string& name)
+    {
+        auto it = scenes.find(name);
+        if (it == scenes.end()) {
+            auto start = std::chrono::steady_clock::now();
+            // same scene every time it is built
+            seed_random(1234);
+            ObjectGroup group = generators.at(name)();
+            it = scenes.emplace(name, Scene{ group.to_wide_bvh(), group.contentHash() }).first;
+            std::cout << "Built scene " << name << " in "
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s" << std::endl;
+        }
+        return it->second;
+    }
+
+    void render(RenderJob& job)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::ofstream file(job.output);
+        if (!file) throw std::runtime_error("cannot write " + job.output);
+        const Scene& scene = sceneFor(job.scene);
+        const Object& world = *scene.bvh;
+        Camera camera = job.camera();
+        uint64_t key = renderKey(scene.hash, camera, job.seed, job.width, job.height, false);
+        // tiles stay on the full frame's grid, so crops share them with the whole frame
+        // (image rows go bottom to top)
+        int w = int(job.width), h = int(job.height);
+        int x0 = int(job.cropX), y0 = h - int(job.cropY + job.cropHeight);
+        int x1 = int(job.cropX + job.cropWidth), y1 = h - int(job.cropY);
+        int tileX0 = x0 / TileSize * TileSize, tileY0 = y0 / TileSize * TileSize;
+        int tiles = ((x1 - tileX0 + TileSize - 1) / TileSize) * ((y1 - tileY0 + TileSize - 1) / TileSize);
+        Image img{ job.width, job.height };
+        std::unique_ptr<Film> film;
+        if (cache) film = std::make_unique<Film>(job.width, job.height);
+        std::atomic<int> fromCache{ 0 };
+        {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            job.tiles = tiles;
+        }
+        job.set(RenderJob::State::Running);
+
+        std::atomic<int> remaining{ tiles };
+        std::mutex doneMutex;
+        std::condition_variable allDone;
+        for (int j = tileY0; j < y1; j += TileSize) {
+            for (int i = tileX0; i < x1; i += TileSize) {
+                pool.addTask([&, i, j]() {
+                    int i1 = std::min(i + TileSize, w), j1 = std::min(j + TileSize, h);
+                    if (cache) {
+                        if (renderCachedTile(*cache, key, *film, camera, world, job.seed, job.spp, i, i1, j, j1) == 0)
+                            fromCache++;
+                    }
+                    else
+                        renderTile(img, camera, world, job.spp, i, i1, j, j1);
+                    {
+                        std::lock_guard<std::mutex> lock(job.mutex);
+                        job.tilesDone++;
+                    }
+                    job.changed.notify_all();
+                    if (--remaining == 0) {
+                        std::lock_guard<std::mutex> lock(doneMutex);
+                        allDone.notify_one();
+                    }
+                });
+            }
+        }
+        {
+            std::unique_lock<std::mutex> lock(doneMutex);
+            allDone.wait(lock, [&]() { return remaining == 0; });
+        }
+
+        if (cache) {
+            film->toImage(img);
+            std::cout << "Job " << job.id << ": " << fromCache << " of " << tiles << " tiles from cache" << std::endl;
+        }
+        if (job.cropWidth != job.width || job.cropHeight != job.height) {
+            Image cropped{ job.cropWidth, job.cropHeight };
+            for (size_t y = 0; y < job.cropHeight; y++)
+                for (size_t x = 0; x < job.cropWidth; x++)
+                    cropped.getPixel(x, y) = img.getPixel(x0 + x, y0 + y);
+            writeImage(std::move(file), cropped);
+        }
+        else
+            writeImage(std::move(file), img);
+        job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        job.set(RenderJob::State::Done);
+    }
+
+    std::string path;
+    int threads;
+    SocketHandle listener = InvalidSocket;
+    bool listenerClosed = false; // under mutex
+    ThreadPool pool;
+    const std::map<std::string, std::function<ObjectGroup()>>& generators;
+    std::map<std::string, Scene> scenes; // only touched by the scheduler
+    std::unique_ptr<TileCache> cache;
+
+    std::mutex mutex;
+    std::condition_variable jobAdded;
+    std::priority_queue<std::shared_ptr<RenderJob>, std::vector<std::shared_ptr<RenderJob>>, ByPriority> queue;
+    uint64_t lastId = 0;
+    std::atomic<bool> stopping{ false }; // written under mutex, read by the accept loop without it
+};
+
+// sends one request to a daemon and prints what comes back
+inline void sendRequest(const std::string& path, const std::string& request)
+{
+    auto connection = LocalConnection::connect(path);
+    connection->writeLine(request);
+    std::string line;
+    while (connection->readLine(line))
+        std::cout << line << std::endl;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "vec3.h"
+#include "film.h"
+#include "threadpool.h"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Each iteration
+// is a 5x5 B3-spline blur whose taps are spread 2^i pixels apart, so a few
+// cheap passes cover a wide footprint. Taps are down-weighted when colour,
+// normal, depth or albedo differ from the centre pixel, which keeps geometric
+// and texture edges sharp. The colour weight tightens every iteration as the
+// noise it has to tolerate goes down.
+struct DenoiseSettings
+{
+    int iterations = 5;
+    float sigmaColor = 1.0f;
+    float sigmaNormal = 0.3f;
+    float sigmaDepth = 0.1f;  // relative to the centre pixel's depth
+    float sigmaAlbedo = 0.3f;
+};
+
+class Denoiser
+{
+public:
+    Denoiser(int threads, DenoiseSettings settings = {})
+        : threads(std::max(1, threads)), settings(settings) {}
+
+    // filters the film's averaged colour, returns linear colour
+    std::vector<Vec3> run(const Film& film) const
+    {
+        size_t width = film.width, height = film.height;
+        std::vector<Vec3> normals(width * height), albedos(width * height);
+        std::vector<float> depths(width * height);
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                normals[y * width + x] = film.normal(x, y);
+                albedos[y * width + x] = film.albedo(x, y);
+                depths[y * width + x] = film.depth(x, y);
+            }
+        }
+
+        std::vector<Vec3> in = film.resolve(), out(width * height);
+        for (int it = 0; it < settings.iterations; it++) {
+            int step = 1 << it;
+            float sigmaColor = settings.sigmaColor / float(step);
+
+            // rows are independent within an iteration
+            ThreadPool tp;
+            constexpr int RowBlock = 16;
+            for (int y0 = 0; y0 < int(height); y0 += RowBlock) {
+                tp.addTask([&, y0]() {
+                    int y1 = std::min(y0 + RowBlock, int(height));
+                    for (int y = y0; y < y1; y++)
+                        for (int x = 0; x < int(width); x++)
+                            out[y * width + x] = filterPixel(x, y, step, sigmaColor, width, height,
+                                in, normals, depths, albedos);
+                });
+            }
+            tp.start(threads);
+            tp.join();
+            std::swap(in, out);
+        }
+        return in;
+    }
+
+private:
+    Vec3 filterPixel(int x, int y, int step, float sigmaColor, size_t width, size_t height,
+        const std::vector<Vec3>& col, const std::vector<Vec3>& normals,
+        const std::vector<float>& depths, const std::vector<Vec3>& albedos) const
+    {
+        static constexpr float kernel[3] = { 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+        size_t center = y * width + x;
+        Vec3 c0 = col[center], n0 = normals[center], a0 = albedos[center];
+        float z0 = depths[center];
+
+        Vec3 sum(0, 0, 0);
+        float weightSum = 0;
+        for (int dy = -2; dy <= 2; dy++) {
+            int qy = y + dy * step;
+            if (qy < 0 || qy >= int(height)) continue;
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = x + dx * step;
+                if (qx < 0 || qx >= int(width)) continue;
+                size_t q = qy * width + qx;
+
+                float dc = (col[q] - c0).squared_length() / (sigmaColor * sigmaColor);
+                float dn = (normals[q] - n0).squared_length() / (settings.sigmaNormal * settings.sigmaNormal);
+                float relDepth = std::fabs(depths[q] - z0) / std::max({ z0, depths[q], 1e-4f });
+                float dz = relDepth * relDepth / (settings.sigmaDepth * settings.sigmaDepth);
+                float da = (albedos[q] - a0).squared_length() / (settings.sigmaAlbedo * settings.sigmaAlbedo);
+
+                float w = kernel[std::abs(dx)] * kernel[std::abs(dy)] * std::exp(-(dc + dn + dz + da));
+                sum += w * col[q];
+                weightSum += w;
+            }
+        }
+        return weightSum > 0 ? sum / weightSum : c0;
+    }
+
+    int threads;
+    DenoiseSettings settings;
+};
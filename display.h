@@ -0,0 +1,159 @@
+#pragma once
+#include <GL/glew.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "vec3.h"
+#include "film.h"
+#include "shader.h"
+
+// Shows a Film in the window. The film lives in a persistent float texture;
+// workers mark tiles dirty when they finish them and upload() streams only
+// those tiles through a pixel buffer object, so the main thread never copies
+// the whole frame. Exposure, tonemapping and gamma are done by the fragment
+// shader on the linear data.
+class FilmDisplay
+{
+public:
+    FilmDisplay(size_t width, size_t height, int tileSize)
+        : width(width), height(height), tileSize(tileSize),
+        tilesX((int(width) + tileSize - 1) / tileSize), tilesY((int(height) + tileSize - 1) / tileSize),
+        dirty(new std::atomic<bool>[tilesX * tilesY])
+    {
+        for (int t = 0; t < tilesX * tilesY; t++) dirty[t] = false;
+
+        Shader vert(GL_VERTEX_SHADER), frag(GL_FRAGMENT_SHADER);
+        vert.compile(loadFile("shaders/display.vert"));
+        frag.compile(loadFile("shaders/display.frag"));
+        program = createProgram(vert, frag);
+        exposureLocation = glGetUniformLocation(program, "exposure");
+        reinhardLocation = glGetUniformLocation(program, "reinhard");
+
+        glGenVertexArrays(1, &vao);
+
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        std::vector<float> black(width * height * 3, 0.0f);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, GLsizei(width), GLsizei(height), 0, GL_RGB, GL_FLOAT, black.data());
+
+        glGenBuffers(1, &pbo);
+    }
+
+    FilmDisplay(const FilmDisplay&) = delete;
+
+    ~FilmDisplay()
+    {
+        glDeleteBuffers(1, &pbo);
+        glDeleteTextures(1, &texture);
+        glDeleteVertexArrays(1, &vao);
+        glDeleteProgram(program);
+    }
+
+    // called by workers once a tile's samples are in the film
+    void markDirty(int i_low, int j_low) noexcept
+    {
+        dirty[(j_low / tileSize) * tilesX + i_low / tileSize].store(true, std::memory_order_release);
+    }
+
+    void markAllDirty() noexcept
+    {
+        for (int t = 0; t < tilesX * tilesY; t++) dirty[t].store(true, std::memory_order_release);
+    }
+
+    // copies finished tiles into the texture, returns whether anything changed
+    bool upload(const Film& film)
+    {
+        std::vector<int> tiles;
+        for (int t = 0; t < tilesX * tilesY; t++)
+            if (dirty[t].exchange(false, std::memory_order_acquire))
+                tiles.push_back(t);
+        if (tiles.empty()) return false;
+
+        size_t bytes = 0;
+        for (int t : tiles) bytes += tileBytes(t);
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        // orphan the previous storage so we never wait on an upload still in flight
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        auto mapped = static_cast<float*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if (!mapped) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            for (int t : tiles) dirty[t] = true;
+            return false;
+        }
+
+        size_t offset = 0;
+        std::vector<size_t> offsets;
+        for (int t : tiles) {
+            offsets.push_back(offset);
+            int x0, x1, y0, y1;
+            tileBounds(t, x0, x1, y0, y1);
+            float* out = mapped + offset / sizeof(float);
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    Vec3 c = film.average(x, y);
+                    *out++ = c[0];
+                    *out++ = c[1];
+                    *out++ = c[2];
+                }
+            }
+            offset += tileBytes(t);
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        for (size_t k = 0; k < tiles.size(); k++) {
+            int x0, x1, y0, y1;
+            tileBounds(tiles[k], x0, x1, y0, y1);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, x0, y0, x1 - x0, y1 - y0, GL_RGB, GL_FLOAT,
+                reinterpret_cast<const void*>(offsets[k]));
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return true;
+    }
+
+    void draw() const
+    {
+        glUseProgram(program);
+        glUniform1f(exposureLocation, exposure);
+        glUniform1i(reinhardLocation, reinhard);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glBindVertexArray(vao);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+    }
+
+    float exposure = 1.0f;
+    bool reinhard = false;
+
+private:
+    void tileBounds(int t, int& x0, int& x1, int& y0, int& y1) const noexcept
+    {
+        x0 = (t % tilesX) * tileSize;
+        y0 = (t / tilesX) * tileSize;
+        x1 = std::min(x0 + tileSize, int(width));
+        y1 = std::min(y0 + tileSize, int(height));
+    }
+
+    size_t tileBytes(int t) const noexcept
+    {
+        int x0, x1, y0, y1;
+        tileBounds(t, x0, x1, y0, y1);
+        return size_t(x1 - x0) * (y1 - y0) * 3 * sizeof(float);
+    }
+
+    size_t width, height;
+    int tileSize, tilesX, tilesY;
+    std::unique_ptr<std::atomic<bool>[]> dirty;
+    GLuint program = 0, vao = 0, texture = 0, pbo = 0;
+    GLint exposureLocation = -1, reinhardLocation = -1;
+};
@@ -0,0 +1,188 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "vec3.h"
+#include "image.h"
+
+// What the camera ray saw first; averaged into the film's feature buffers.
+struct FirstHit
+{
+    Vec3 albedo;
+    Vec3 normal;
+    float depth = 0;
+};
+
+// depth stored for camera rays that miss everything
+constexpr float FarDepth = 1e5f;
+
+// Float accumulation buffer. Unlike Image it keeps the running sum of every
+// pixel's samples, so passes can be added one after another and the current
+// average is always a complete picture. Tiles never overlap, so workers write
+// without locking.
+struct Film
+{
+    explicit Film(size_t width, size_t height)
+        : width(width), height(height), sum(width * height), sumLumSq(width * height), samples(width * height),
+        albedoSum(width * height), normalSum(width * height), depthSum(width * height),
+        history(width * height), historyWeight(width * height), historyDepth(width * height)
+    {
+    }
+
+    void addSample(size_t x, size_t y, const Vec3& col) noexcept
+    {
+        size_t idx = y * width + x;
+        float lum = luminance(col);
+        sum[idx] += col;
+        sumLumSq[idx] += lum * lum;
+        samples[idx]++;
+    }
+
+    // call once per sample, next to addSample
+    void addFeatures(size_t x, size_t y, const FirstHit& hit) noexcept
+    {
+        size_t idx = y * width + x;
+        albedoSum[idx] += hit.albedo;
+        normalSum[idx] += hit.normal;
+        depthSum[idx] += hit.depth;
+    }
+
+    Vec3 average(size_t x, size_t y) const noexcept
+    {
+        size_t idx = y * width + x;
+        unsigned n = samples[idx];
+        float w = historyWeight[idx] * std::max(0.0f, 1 - n / HistorySamples);
+        return n + w > 0 ? (sum[idx] + w * history[idx]) / (n + w) : Vec3(0, 0, 0);
+    }
+
+    Vec3 albedo(size_t x, size_t y) const noexcept
+    {
+        size_t idx = y * width + x;
+        return samples[idx] ? albedoSum[idx] / float(samples[idx]) : Vec3(0, 0, 0);
+    }
+
+    Vec3 normal(size_t x, size_t y) const noexcept
+    {
+        Vec3 n = normalSum[y * width + x];
+        float len = n.length();
+        return len > 0 ? n / len : n;
+    }
+
+    float depth(size_t x, size_t y) const noexcept
+    {
+        size_t idx = y * width + x;
+        if (samples[idx]) return depthSum[idx] / samples[idx];
+        return historyWeight[idx] > 0 ? historyDepth[idx] : FarDepth;
+    }
+
+    // whether the pixel has anything to show, fresh or reprojected
+    bool covered(size_t x, size_t y) const noexcept
+    {
+        size_t idx = y * width + x;
+        return samples[idx] || historyWeight[idx] > 0;
+    }
+
+    // variance of the pixel's mean luminance, i.e. how much another sample would still help
+    float varianceOfMean(size_t x, size_t y) const noexcept
+    {
+        size_t idx = y * width + x;
+        unsigned n = samples[idx];
+        if (n < 2) return 0;
+        float mean = luminance(sum[idx]) / n;
+        float variance = std::max(0.0f, (sumLumSq[idx] / n - mean * mean) * n / (n - 1));
+        return variance / n;
+    }
+
+    void clear() noexcept
+    {
+        std::fill(sum.begin(), sum.end(), Vec3(0, 0, 0));
+        std::fill(sumLumSq.begin(), sumLumSq.end(), 0.0f);
+        std::fill(samples.begin(), samples.end(), 0u);
+        std::fill(albedoSum.begin(), albedoSum.end(), Vec3(0, 0, 0));
+        std::fill(normalSum.begin(), normalSum.end(), Vec3(0, 0, 0));
+        std::fill(depthSum.begin(), depthSum.end(), 0.0f);
+        std::fill(history.begin(), history.end(), Vec3(0, 0, 0));
+        std::fill(historyWeight.begin(), historyWeight.end(), 0.0f);
+        std::fill(historyDepth.begin(), historyDepth.end(), 0.0f);
+    }
+
+    std::vector<Vec3> resolve() const
+    {
+        std::vector<Vec3> ret(width * height);
+        for (size_t y = 0; y < height; y++)
+            for (size_t x = 0; x < width; x++)
+                ret[y * width + x] = average(x, y);
+        return ret;
+    }
+
+    void toImage(Image& img) const
+    {
+        writeLinear(resolve(), img);
+    }
+
+    // feature buffers as viewable images: albedo as is, normals mapped to [0, 1],
+    // depth as white (near) to black (far, or missed)
+    void albedoToImage(Image& img) const
+    {
+        for (size_t y = 0; y < height; y++)
+            for (size_t x = 0; x < width; x++)
+                img.getPixel(x, y).setPixel(clamp01(albedo(x, y)) * 255.99);
+    }
+    void normalToImage(Image& img) const
+    {
+        for (size_t y = 0; y < height; y++)
+            for (size_t x = 0; x < width; x++)
+                img.getPixel(x, y).setPixel((0.5f * normal(x, y) + Vec3(0.5, 0.5, 0.5)) * 255.99);
+    }
+    void depthToImage(Image& img) const
+    {
+        float maxDepth = 0;
+        for (size_t y = 0; y < height; y++)
+            for (size_t x = 0; x < width; x++)
+                if (depth(x, y) < FarDepth) maxDepth = std::max(maxDepth, depth(x, y));
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                float d = maxDepth > 0 ? 1 - std::min(depth(x, y) / maxDepth, 1.0f) : 0;
+                img.getPixel(x, y).setPixel(Vec3(d, d, d) * 255.99);
+            }
+        }
+    }
+
+    // gamma 2 and clamp, like the viewer's output
+    static void writeLinear(const std::vector<Vec3>& linear, Image& img)
+    {
+        for (size_t y = 0; y < img.height; y++) {
+            for (size_t x = 0; x < img.width; x++) {
+                Vec3 col = clamp01(linear[y * img.width + x]);
+                img.getPixel(x, y).setPixel(Vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2])) * 255.99);
+            }
+        }
+    }
+
+    static Vec3 clamp01(const Vec3& c) noexcept
+    {
+        return Vec3(std::min(std::max(c[0], 0.0f), 1.0f), std::min(std::max(c[1], 0.0f), 1.0f),
+            std::min(std::max(c[2], 0.0f), 1.0f));
+    }
+
+    static float luminance(const Vec3& c) noexcept
+    {
+        return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+    }
+
+    size_t width, height;
+    std::vector<Vec3> sum;
+    std::vector<float> sumLumSq;
+    std::vector<unsigned> samples;
+    std::vector<Vec3> albedoSum;
+    std::vector<Vec3> normalSum;
+    std::vector<float> depthSum;
+
+    // Colour and depth carried over from before the last camera move (see
+    // reprojection.h). A pixel's history counts as historyWeight samples and
+    // fades out over its first HistorySamples fresh ones.
+    static constexpr float HistorySamples = 4;
+    std::vector<Vec3> history;
+    std::vector<float> historyWeight;
+    std::vector<float> historyDepth;
+};
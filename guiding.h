@@ -0,0 +1,342 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "vec3.h"
+#include "random.h"
+#include "objects.h"
+#include "film.h"
+
+// Distribution over directions: a quadtree over the square that
+// (cos theta, phi) maps onto the sphere with equal area. Every node keeps the
+// energy that landed in each of its four quadrants.
+class DirectionTree
+{
+public:
+    static constexpr int MaxDepth = 20;
+
+    DirectionTree() : nodes(1) {}
+
+    static void toSquare(const Vec3& dir, float& u, float& v) noexcept
+    {
+        u = std::clamp(0.5f * (dir.z() + 1), 0.0f, 1.0f);
+        float phi = std::atan2(dir.y(), dir.x());
+        v = std::clamp(float(phi < 0 ? phi + 2 * PI : phi) / float(2 * PI), 0.0f, 1.0f);
+    }
+
+    static Vec3 fromSquare(float u, float v) noexcept
+    {
+        float cosTheta = 2 * u - 1, sinTheta = std::sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+        float phi = float(2 * PI) * v;
+        return Vec3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+    }
+
+    void splat(float u, float v, float value) noexcept
+    {
+        uint32_t n = 0;
+        for (;;) {
+            int q = quadrant(u, v);
+            nodes[n].energy[q] += value;
+            if (!nodes[n].child[q]) break;
+            n = nodes[n].child[q];
+        }
+        samples++;
+    }
+
+    float total() const noexcept
+    {
+        auto& e = nodes[0].energy;
+        return e[0] + e[1] + e[2] + e[3];
+    }
+
+    // picks a direction with probability proportional to the energy, total() must be > 0
+    Vec3 sample() const noexcept
+    {
+        float u0 = 0, v0 = 0, size = 1;
+        uint32_t n = 0;
+        for (;;) {
+            auto& node = nodes[n];
+            float r = float(random_double()) * (node.energy[0] + node.energy[1] + node.energy[2] + node.energy[3]);
+            int q = 0;
+            while (q < 3 && (r >= node.energy[q] || node.energy[q] <= 0)) {
+                r -= node.energy[q];
+                q++;
+            }
+            size *= 0.5f;
+            u0 += (q & 1) * size;
+            v0 += (q >> 1) * size;
+            if (!node.child[q]) break;
+            n = node.child[q];
+        }
+        return fromSquare(u0 + float(random_double()) * size, v0 + float(random_double()) * size);
+    }
+
+    // solid angle density of sample()
+    float pdf(const Vec3& dir) const noexcept
+    {
+        float u, v;
+        toSquare(dir, u, v);
+        float p = 1;
+        uint32_t n = 0;
+        for (;;) {
+            auto& node = nodes[n];
+            float sum = node.energy[0] + node.energy[1] + node.energy[2] + node.energy[3];
+            int q = quadrant(u, v);
+            if (sum <= 0 || node.energy[q] <= 0) return 0;
+            p *= 4 * node.energy[q] / sum;
+            if (!node.child[q]) break;
+            n = node.child[q];
+        }
+        return p / float(4 * PI);
+    }
+
+    // empty tree, with quadrants holding more than `threshold` of the energy
+    // split so the next round of training resolves them finer
+    DirectionTree refined(float threshold) const
+    {
+        DirectionTree ret;
+        float limit = threshold * total();
+        if (limit > 0)
+            ret.subdivide(*this, 0, &nodes[0], nodes[0].energy, 0, limit);
+        return ret;
+    }
+
+    size_t samples = 0;
+
+private:
+    struct Node
+    {
+        float energy[4] = {};
+        uint32_t child[4] = {}; // 0 for none, the root is never a child
+    };
+
+    // quadrant of (u, v), which is then rescaled to that quadrant
+    static int quadrant(float& u, float& v) noexcept
+    {
+        int q = 0;
+        if (u >= 0.5f) { q |= 1; u = 2 * u - 1; }
+        else u *= 2;
+        if (v >= 0.5f) { q |= 2; v = 2 * v - 1; }
+        else v *= 2;
+        return q;
+    }
+
+    // `from` is the node of `source` matching `at`, null below its leaves,
+    // where energy is taken to be spread evenly
+    void subdivide(const DirectionTree& source, uint32_t at, const Node* from, const float (&energy)[4], int depth, float limit)
+    {
+        if (depth >= MaxDepth) return;
+        for (int q = 0; q < 4; q++) {
+            if (energy[q] <= limit) continue;
+            const Node* next = from && from->child[q] ? &source.nodes[from->child[q]] : nullptr;
+            float childEnergy[4];
+            for (int c = 0; c < 4; c++)
+                childEnergy[c] = next ? next->energy[c] : energy[q] / 4;
+            auto child = uint32_t(nodes.size());
+            nodes.emplace_back();
+            nodes[at].child[q] = child;
+            subdivide(source, child, next, childEnergy, depth + 1, limit);
+        }
+    }
+
+    std::vector<Node> nodes;
+};
+
+// Learns where light comes from while rendering (after "Practical Path
+// Guiding", Mueller et al.). A binary tree splits the scene bounds, cycling
+// through the axes, and each leaf holds a DirectionTree of the radiance
+// arriving there. Renders run in passes: diffuse bounces during a pass are
+// recorded into per-thread buffers, and update() merges them and builds the
+// next pass's distributions, splitting leaves that saw many samples and
+// refining the quadtrees where energy concentrates. Diffuse bounces then mix
+// sampling the learned distribution with cosine sampling, which keeps the
+// estimate unbiased where the guide is wrong or hasn't seen anything yet.
+class PathGuide
+{
+public:
+    static constexpr float GuideFraction = 0.5f;      // of diffuse bounces that follow the guide
+    static constexpr float SpatialThreshold = 12000;  // records per leaf before it splits
+    static constexpr float DirectionThreshold = 0.01f; // energy fraction before a quadrant splits
+    static constexpr size_t FlushSize = 1 << 14;       // records a thread buffers before merging
+
+    PathGuide() : id(++lastId())
+    {
+        spatial.push_back(SpatialNode{});
+        leaves.emplace_back();
+    }
+
+    // whether update() has run, i.e. there is something to sample
+    bool trained() const noexcept { return iteration > 0; }
+
+    // Picks a bounce direction at a diffuse surface at p with normal n. Returns
+    // false for directions below the surface. `weight` is cosine/pi over the
+    // mixture pdf, i.e. what the Lambertian albedo gets multiplied by.
+    bool sampleDiffuse(const Vec3& p, const Vec3& n, Vec3& dir, float& weight, float& pdf) const noexcept
+    {
+        const DirectionTree& tree = leaves[locate(p)].sampling;
+        bool guided = trained() && tree.total() > 0;
+        if (guided && random_double() < GuideFraction)
+            dir = tree.sample();
+        else
+            dir = random_cosine_direction(n);
+        float cosine = dot(dir, n);
+        if (cosine <= 0) return false;
+        float bsdfPdf = cosine / float(PI);
+        pdf = guided ? GuideFraction * tree.pdf(dir) + (1 - GuideFraction) * bsdfPdf : bsdfPdf;
+        weight = bsdfPdf / pdf;
+        return true;
+    }
+
+    // density of sampleDiffuse() picking dir
+    float pdfDiffuse(const Vec3& p, const Vec3& n, const Vec3& dir) const noexcept
+    {
+        float bsdfPdf = std::max(0.0f, dot(dir, n)) / float(PI);
+        const DirectionTree& tree = leaves[locate(p)].sampling;
+        if (!trained() || tree.total() <= 0) return bsdfPdf;
+        return GuideFraction * tree.pdf(dir) + (1 - GuideFraction) * bsdfPdf;
+    }
+
+    // radiance (luminance) arriving at p from dir, sampled with density pdf
+    void record(const Vec3& p, const Vec3& dir, const Vec3& radiance, float pdf)
+    {
+        float value = Film::luminance(radiance) / pdf;
+        if (!std::isfinite(value)) return;
+        float u, v;
+        DirectionTree::toSquare(dir, u, v);
+        auto& buffer = localBuffer();
+        buffer.push_back(Record{ p, u, v, value });
+        if (buffer.size() >= FlushSize) {
+            std::lock_guard<std::mutex> lock(mutex);
+            merge(buffer);
+        }
+    }
+
+    // merges everything recorded and rebuilds the distributions; call between
+    // passes, while nothing is rendering
+    void update()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& buffer : buffers) merge(*buffer);
+        buffers.clear();
+        generation++;
+
+        // The spatial tree covers where the first pass's bounces landed rather
+        // than the scene bounds, which the ground sphere alone makes kilometres
+        // wide. There is only the root before this, so nothing needs moving.
+        if (iteration == 0 && leaves[0].building.samples > 0) {
+            Vec3 margin = 0.01f * (recordedHi - recordedLo) + Vec3(1e-3f, 1e-3f, 1e-3f);
+            lo = recordedLo - margin;
+            hi = recordedHi + margin;
+        }
+
+        float threshold = SpatialThreshold * std::sqrt(float(1 << std::min(iteration, 16)));
+        for (size_t leaf = 0, count = spatial.size(); leaf < count; leaf++)
+            if (!spatial[leaf].child[0]) split(uint32_t(leaf), threshold);
+        for (auto& leaf : leaves) {
+            if (leaf.building.samples > 0) leaf.sampling = leaf.building;
+            leaf.building = leaf.sampling.refined(DirectionThreshold);
+        }
+        iteration++;
+    }
+
+    size_t leafCount() const noexcept { return leaves.size(); }
+
+private:
+    struct Record
+    {
+        Vec3 p;
+        float u, v, value;
+    };
+
+    struct SpatialNode
+    {
+        int axis = 0;
+        uint32_t child[2] = {}; // 0 for a leaf
+        uint32_t leaf = 0;
+    };
+
+    struct Leaf
+    {
+        DirectionTree sampling, building;
+    };
+
+    uint32_t locate(const Vec3& p) const noexcept
+    {
+        Vec3 rel = (p - lo) / (hi - lo);
+        float x[3] = { std::clamp(rel.x(), 0.0f, 1.0f), std::clamp(rel.y(), 0.0f, 1.0f), std::clamp(rel.z(), 0.0f, 1.0f) };
+        uint32_t n = 0;
+        while (spatial[n].child[0]) {
+            float& c = x[spatial[n].axis];
+            int side = c >= 0.5f;
+            c = side ? 2 * c - 1 : 2 * c;
+            n = spatial[n].child[side];
+        }
+        return spatial[n].leaf;
+    }
+
+    // both halves start from a copy of the leaf, each counted as half its samples
+    void split(uint32_t node, float threshold)
+    {
+        Leaf& leaf = leaves[spatial[node].leaf];
+        if (leaf.building.samples <= threshold) return;
+        leaf.building.samples /= 2;
+        Leaf copy = leaf;
+        auto first = uint32_t(spatial.size());
+        int axis = (spatial[node].axis + 1) % 3;
+        spatial.push_back(SpatialNode{ axis, {}, spatial[node].leaf });
+        spatial.push_back(SpatialNode{ axis, {}, uint32_t(leaves.size()) });
+        leaves.push_back(std::move(copy));
+        spatial[node].child[0] = first;
+        spatial[node].child[1] = first + 1;
+        split(first, threshold);
+        split(first + 1, threshold);
+    }
+
+    // call with the mutex held
+    void merge(std::vector<Record>& buffer)
+    {
+        for (auto& r : buffer) {
+            leaves[locate(r.p)].building.splat(r.u, r.v, r.value);
+            recordedLo = vmin(recordedLo, r.p);
+            recordedHi = vmax(recordedHi, r.p);
+        }
+        buffer.clear();
+    }
+
+    // this thread's buffer for this guide and pass; the guide owns it so
+    // records survive the pool's threads exiting before update()
+    std::vector<Record>& localBuffer()
+    {
+        struct Cached { uint64_t id = 0, generation = 0; std::vector<Record>* buffer = nullptr; };
+        thread_local Cached cached;
+        uint64_t current = generation.load(std::memory_order_relaxed);
+        if (cached.id != id || cached.generation != current || !cached.buffer) {
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.push_back(std::make_unique<std::vector<Record>>());
+            cached = Cached{ id, current, buffers.back().get() };
+        }
+        return *cached.buffer;
+    }
+
+    static std::atomic<uint64_t>& lastId()
+    {
+        static std::atomic<uint64_t> ret{ 0 };
+        return ret;
+    }
+
+    uint64_t id;
+    std::atomic<uint64_t> generation{ 0 };
+    int iteration = 0;
+    Vec3 lo{ 0, 0, 0 }, hi{ 1, 1, 1 };
+    Vec3 recordedLo{ FLT_MAX, FLT_MAX, FLT_MAX }, recordedHi{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    std::vector<SpatialNode> spatial;
+    std::vector<Leaf> leaves;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<std::vector<Record>>> buffers;
+};
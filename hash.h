@@ -0,0 +1,29 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "vec3.h"
+
+// FNV-1a over whatever is added, in order
+class Hasher
+{
+public:
+    Hasher& add(const void* data, size_t bytes) noexcept
+    {
+        auto p = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < bytes; i++) {
+            h ^= p[i];
+            h *= 0x100000001B3ull;
+        }
+        return *this;
+    }
+    Hasher& add(uint64_t v) noexcept { return add(&v, sizeof(v)); }
+    Hasher& add(float v) noexcept { return add(&v, sizeof(v)); }
+    Hasher& add(const Vec3& v) noexcept { return add(v[0]).add(v[1]).add(v[2]); }
+    Hasher& add(const std::string& s) noexcept { return add(uint64_t(s.size())).add(s.data(), s.size()); }
+
+    uint64_t value() const noexcept { return h; }
+
+private:
+    uint64_t h = 0xCBF29CE484222325ull;
+};
@@ -1,10 +1,17 @@
 #pragma once
+#include <memory>
+#include "vec3.h"
 
 class Material;
+class Object;
 struct HitInfo
 {
     float t;
     Vec3 p;
     Vec3 normal;
     std::shared_ptr<Material> material;
+    float u = 0, v = 0;      // surface parameterisation for textures
+    float uvScale = 1;       // rough world-space length of one uv unit
+    float footprint = 0;     // width of the ray footprint here, set by the integrator
+    const Object* object = nullptr; // set by objects that can be sampled as lights
 };
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdexcept>
+#include <cstring>
 #include <fstream>
 
 struct Pixel
@@ -7,9 +8,9 @@ struct Pixel
     unsigned char r, g, b;
     void setPixel(Vec3 rgb) noexcept
     {
-        this->r = unsigned char(rgb.r());
-        this->g = unsigned char(rgb.g());
-        this->b = unsigned char(rgb.b());
+        this->r = static_cast<unsigned char>(rgb.r());
+        this->g = static_cast<unsigned char>(rgb.g());
+        this->b = static_cast<unsigned char>(rgb.b());
     }
 };
 
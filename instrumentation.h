@@ -0,0 +1,274 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "vec3.h"
+#include "image.h"
+
+// Hot-path counters and timings. Everything here is compiled out unless
+// RAYTRACER_INSTRUMENT is defined; the INSTRUMENT_* macros below are the only
+// thing the renderer itself touches.
+//
+// Each thread bumps its own ThreadStats (relaxed load + store, so no locked
+// instructions and no shared cache lines); aggregate() sums them on demand.
+
+constexpr int MaxTrackedDepth = 64;
+
+struct TileEvent
+{
+    int i_low, i_high, j_low, j_high;
+    double start_us, duration_us;
+};
+
+// aligned (and so padded) to a cache line, so no two threads' counters share one
+struct alignas(64) ThreadStats
+{
+    int index = 0;
+    std::atomic<size_t> bvhNodesVisited{ 0 };
+    std::atomic<size_t> primitiveTests{ 0 };
+    std::atomic<size_t> raysByDepth[MaxTrackedDepth]{};
+    std::atomic<size_t> pathsByLength[MaxTrackedDepth]{};
+
+    std::mutex tileMutex; // only contended while somebody is writing a trace
+    std::vector<TileEvent> tiles;
+};
+
+struct InstrumentationTotals
+{
+    size_t bvhNodesVisited = 0;
+    size_t primitiveTests = 0;
+    size_t raysByDepth[MaxTrackedDepth]{};
+    size_t pathsByLength[MaxTrackedDepth]{};
+
+    size_t rays() const {
+        size_t sum = 0;
+        for (auto n : raysByDepth) sum += n;
+        return sum;
+    }
+    size_t paths() const {
+        size_t sum = 0;
+        for (auto n : pathsByLength) sum += n;
+        return sum;
+    }
+    double meanBounces() const {
+        size_t weighted = 0;
+        for (int d = 0; d < MaxTrackedDepth; d++) weighted += pathsByLength[d] * d;
+        return paths() ? double(weighted) / paths() : 0.0;
+    }
+};
+
+class Instrumentation
+{
+public:
+    static Instrumentation& instance()
+    {
+        static Instrumentation inst;
+        return inst;
+    }
+
+    ThreadStats& local()
+    {
+        // the pool recreates its workers on every restart, so slots of exited
+        // threads are handed to new ones instead of growing the list forever
+        struct Slot
+        {
+            ThreadStats* stats;
+            ~Slot() { Instrumentation::instance().releaseThread(stats); }
+        };
+        thread_local Slot slot{ registerThread() };
+        return *slot.stats;
+    }
+
+    static void bump(std::atomic<size_t>& counter) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // clears counters, tile events and the per-pixel cost buffer; call it
+    // while no worker is rendering
+    void reset(size_t width, size_t height)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& stats : threads) {
+            stats->bvhNodesVisited = 0;
+            stats->primitiveTests = 0;
+            for (auto& n : stats->raysByDepth) n = 0;
+            for (auto& n : stats->pathsByLength) n = 0;
+            std::lock_guard<std::mutex> tileLock(stats->tileMutex);
+            stats->tiles.clear();
+        }
+        this->width = width;
+        this->height = height;
+        pixelCost.reset(new std::atomic<float>[width * height]);
+        for (size_t i = 0; i < width * height; i++) pixelCost[i] = 0;
+        epoch = std::chrono::steady_clock::now();
+    }
+
+    double now_us() const
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    // adds to the pixel's cost; a pixel is only ever written by the thread rendering its tile
+    void recordPixel(size_t x, size_t y, float microseconds) noexcept
+    {
+        if (x < width && y < height) {
+            auto& cost = pixelCost[y * width + x];
+            cost.store(cost.load(std::memory_order_relaxed) + microseconds, std::memory_order_relaxed);
+        }
+    }
+
+    void recordTile(const TileEvent& event)
+    {
+        auto& stats = local();
+        std::lock_guard<std::mutex> lock(stats.tileMutex);
+        stats.tiles.push_back(event);
+    }
+
+    InstrumentationTotals aggregate()
+    {
+        InstrumentationTotals totals;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& stats : threads) {
+            totals.bvhNodesVisited += stats->bvhNodesVisited;
+            totals.primitiveTests += stats->primitiveTests;
+            for (int d = 0; d < MaxTrackedDepth; d++) {
+                totals.raysByDepth[d] += stats->raysByDepth[d];
+                totals.pathsByLength[d] += stats->pathsByLength[d];
+            }
+        }
+        return totals;
+    }
+
+    void report(std::ostream& os)
+    {
+        auto totals = aggregate();
+        os << "rays: " << totals.rays() << ", paths: " << totals.paths()
+            << ", mean bounces: " << totals.meanBounces() << "\n"
+            << "bvh nodes visited: " << totals.bvhNodesVisited
+            << " (" << double(totals.bvhNodesVisited) / std::max<size_t>(1, totals.rays()) << "/ray)"
+            << ", primitive tests: " << totals.primitiveTests
+            << " (" << double(totals.primitiveTests) / std::max<size_t>(1, totals.rays()) << "/ray)\n"
+            << "rays by depth:";
+        for (int d = 0; d < MaxTrackedDepth && totals.raysByDepth[d]; d++)
+            os << " " << totals.raysByDepth[d];
+        os << std::endl;
+    }
+
+    // Chrome trace-event format, open with chrome://tracing or ui.perfetto.dev
+    void writeTrace(std::ofstream&& file)
+    {
+        file << "{\"traceEvents\":[";
+        bool first = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& stats : threads) {
+            std::lock_guard<std::mutex> tileLock(stats->tileMutex);
+            for (auto& tile : stats->tiles) {
+                file << (first ? "\n" : ",\n")
+                    << "{\"name\":\"tile " << tile.i_low << "," << tile.j_low << "\",\"ph\":\"X\",\"pid\":0"
+                    << ",\"tid\":" << stats->index << ",\"ts\":" << tile.start_us << ",\"dur\":" << tile.duration_us
+                    << ",\"args\":{\"x\":[" << tile.i_low << "," << tile.i_high << "],\"y\":["
+                    << tile.j_low << "," << tile.j_high << "]}}";
+                first = false;
+            }
+        }
+        file << "\n]}\n";
+    }
+
+    // per-pixel render time, blue (cheap) to red (expensive), scaled to the slowest pixel
+    void writeHeatmap(std::ofstream&& file)
+    {
+        Image heatmap{ width, height };
+        float maxCost = 0;
+        for (size_t i = 0; i < width * height; i++) maxCost = std::max(maxCost, pixelCost[i].load());
+        for (size_t y = 0; y < height; y++) {
+            for (size_t x = 0; x < width; x++) {
+                float t = maxCost > 0 ? pixelCost[y * width + x] / maxCost : 0;
+                Vec3 col = t < 0.5f
+                    ? Vec3(0, 2 * t, 1 - 2 * t)
+                    : Vec3(2 * t - 1, 2 - 2 * t, 0);
+                heatmap.getPixel(x, y).setPixel(col * 255.99);
+            }
+        }
+        writeImage(std::move(file), heatmap);
+    }
+
+private:
+    Instrumentation() = default;
+
+    ThreadStats* registerThread()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!released.empty()) {
+            auto stats = released.back();
+            released.pop_back();
+            return stats;
+        }
+        threads.push_back(std::make_unique<ThreadStats>());
+        threads.back()->index = int(threads.size() - 1);
+        return threads.back().get();
+    }
+
+    void releaseThread(ThreadStats* stats)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        released.push_back(stats);
+    }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadStats>> threads;
+    std::vector<ThreadStats*> released;
+    std::unique_ptr<std::atomic<float>[]> pixelCost;
+    size_t width = 0, height = 0;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+};
+
+// Times the enclosing scope and files it as a tile event.
+class TileTimer
+{
+public:
+    TileTimer(int i_low, int i_high, int j_low, int j_high)
+        : event{ i_low, i_high, j_low, j_high, Instrumentation::instance().now_us(), 0 } {}
+    ~TileTimer()
+    {
+        event.duration_us = Instrumentation::instance().now_us() - event.start_us;
+        Instrumentation::instance().recordTile(event);
+    }
+private:
+    TileEvent event;
+};
+
+// Times the enclosing scope and adds it to the cost of one pixel.
+class PixelTimer
+{
+public:
+    PixelTimer(size_t x, size_t y) : x(x), y(y), start(std::chrono::steady_clock::now()) {}
+    ~PixelTimer()
+    {
+        float us = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - start).count();
+        Instrumentation::instance().recordPixel(x, y, us);
+    }
+private:
+    size_t x, y;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifdef RAYTRACER_INSTRUMENT
+#define INSTRUMENT_COUNT(counter) Instrumentation::bump(Instrumentation::instance().local().counter)
+#define INSTRUMENT_RAY(depth) Instrumentation::bump(Instrumentation::instance().local().raysByDepth[std::min(int(depth), MaxTrackedDepth - 1)])
+#define INSTRUMENT_PATH_END(depth) Instrumentation::bump(Instrumentation::instance().local().pathsByLength[std::min(int(depth), MaxTrackedDepth - 1)])
+#define INSTRUMENT_TILE(i_low, i_high, j_low, j_high) TileTimer tileTimer_(i_low, i_high, j_low, j_high)
+#define INSTRUMENT_PIXEL(x, y) PixelTimer pixelTimer_(x, y)
+#else
+#define INSTRUMENT_COUNT(counter) ((void)0)
+#define INSTRUMENT_RAY(depth) ((void)0)
+#define INSTRUMENT_PATH_END(depth) ((void)0)
+#define INSTRUMENT_TILE(i_low, i_high, j_low, j_high) ((void)0)
+#define INSTRUMENT_PIXEL(x, y) ((void)0)
+#endif
@@ -0,0 +1,123 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "vec3.h"
+#include "ray.h"
+#include "objects.h"
+#include "instrumentation.h"
+
+// BVH that is built as rays need it. Only the top `eagerDepth` levels are
+// split up front; below that a node is just a range of primitives and its
+// box, and it is split into two children the first time a ray enters it
+// (std::call_once, so threads racing for the same node wait for one build).
+// Parts of the scene no ray reaches are never built, which keeps the time
+// to the first pixel low for big scenes seen only in part.
+//
+// All nodes share one primitive array. A node's range is only reordered
+// while that node is being split, before any node below it exists, so
+// splits of different nodes never touch the same elements.
+class LazyBVHNode : public Object
+{
+public:
+    static constexpr size_t MaxLeafSize = 4;
+
+    struct Prim
+    {
+        Vec3 lo, hi, centroid;
+        std::shared_ptr<Object> object;
+        SceneFeatures features;
+    };
+
+    LazyBVHNode(const std::vector<std::shared_ptr<Object>>& objects, int eagerDepth)
+        : prims(std::make_shared<std::vector<Prim>>()), begin(0), end(objects.size())
+    {
+        prims->reserve(objects.size());
+        for (auto& obj : objects) {
+            AABB box;
+            if (!obj->bounding_box(box))
+                std::cerr << "no bounding box in LazyBVHNode constructor\n";
+            prims->push_back(Prim{ box.min(), box.max(), 0.5f * (box.min() + box.max()), obj, obj->features() });
+        }
+        init(eagerDepth);
+    }
+
+    LazyBVHNode(std::shared_ptr<std::vector<Prim>> prims, size_t begin, size_t end, int eagerDepth)
+        : prims(std::move(prims)), begin(begin), end(end)
+    {
+        init(eagerDepth);
+    }
+
+    [[nodiscard]] std::optional<HitInfo> hit(const Ray& r, float t_min, float t_max) const noexcept override
+    {
+        INSTRUMENT_COUNT(bvhNodesVisited);
+        if (begin == end || !hit_slabs(boxMin, boxMax, r.origin(), r.inv_direction(), t_min, t_max))
+            return {};
+        if (end - begin <= MaxLeafSize) {
+            std::optional<HitInfo> ret;
+            for (size_t i = begin; i < end; i++) {
+                if (auto info = (*prims)[i].object->hit(r, t_min, t_max)) {
+                    t_max = info->t;
+                    ret = info;
+                }
+            }
+            return ret;
+        }
+        std::call_once(built, [this]() { split(0); });
+        auto left_rec = left->hit(r, t_min, t_max);
+        auto right_rec = right->hit(r, t_min, left_rec ? left_rec->t : t_max);
+        return right_rec ? right_rec : left_rec;
+    }
+    [[nodiscard]] bool bounding_box(AABB& box) const noexcept override {
+        box = AABB(boxMin, boxMax);
+        return begin != end;
+    }
+    [[nodiscard]] SceneFeatures features() const noexcept override { return sceneFeatures; }
+
+private:
+    void init(int eagerDepth)
+    {
+        if (begin == end) return;
+        auto& p = *prims;
+        boxMin = p[begin].lo;
+        boxMax = p[begin].hi;
+        for (size_t i = begin; i < end; i++) {
+            boxMin = vmin(boxMin, p[i].lo);
+            boxMax = vmax(boxMax, p[i].hi);
+            sceneFeatures |= p[i].features;
+        }
+        if (eagerDepth > 0 && end - begin > MaxLeafSize)
+            std::call_once(built, [this, eagerDepth]() { split(eagerDepth - 1); });
+    }
+
+    // median split along the widest axis of the centroids
+    void split(int eagerDepth) const
+    {
+        auto& p = *prims;
+        Vec3 clo = p[begin].centroid, chi = clo;
+        for (size_t i = begin + 1; i < end; i++) {
+            clo = vmin(clo, p[i].centroid);
+            chi = vmax(chi, p[i].centroid);
+        }
+        Vec3 extent = chi - clo;
+        int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+        size_t mid = (begin + end) / 2;
+        std::nth_element(p.begin() + begin, p.begin() + mid, p.begin() + end,
+            [axis](const Prim& a, const Prim& b) { return a.centroid[axis] < b.centroid[axis]; });
+        left = std::make_unique<LazyBVHNode>(prims, begin, mid, eagerDepth);
+        right = std::make_unique<LazyBVHNode>(prims, mid, end, eagerDepth);
+    }
+
+    std::shared_ptr<std::vector<Prim>> prims;
+    size_t begin, end;
+    Vec3 boxMin, boxMax;
+    SceneFeatures sceneFeatures;
+    mutable std::once_flag built;
+    mutable std::unique_ptr<LazyBVHNode> left, right;
+};
+
+inline std::shared_ptr<LazyBVHNode> ObjectGroup::to_lazy_bvh(int eagerDepth) const
+{
+    return std::make_shared<LazyBVHNode>(objects, eagerDepth);
+}
@@ -0,0 +1,224 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "vec3.h"
+#include "random.h"
+#include "objects.h"
+
+// Hierarchy over the scene's emitters for next-event estimation (after
+// "Importance Sampling of Many Lights", Conty Estevez and Kulla). Each node
+// bounds its lights' positions, total power and the cone their normals fall
+// in. A light is picked for a shading point by walking down from the root,
+// taking each child with probability proportional to a conservative guess
+// of how much it can contribute there: power over squared distance, cut
+// down by how far the node faces away from the point and the point from it.
+// Picking costs one walk down the tree, so it grows with the log of the
+// number of lights, and far, small or turned-away lights are rarely picked.
+class LightBVH
+{
+public:
+    explicit LightBVH(const std::vector<std::shared_ptr<Object>>& objects)
+    {
+        std::vector<uint32_t> order;
+        for (auto& obj : objects) {
+            LightBounds bounds;
+            if (!obj->lightBounds(bounds)) continue;
+            order.push_back(uint32_t(lights.size()));
+            lights.push_back(Light{ obj, bounds, 0 });
+        }
+        if (!lights.empty())
+            build(order, 0, order.size(), 0, 0);
+        for (uint32_t i = 0; i < lights.size(); i++)
+            index.emplace(lights[i].object.get(), i);
+    }
+
+    bool empty() const noexcept { return lights.empty(); }
+    size_t size() const noexcept { return lights.size(); }
+
+    // picks a light for a point p with normal n; `pmf` is the chance of that pick
+    const Object* pick(const Vec3& p, const Vec3& n, float& pmf) const noexcept
+    {
+        if (lights.empty()) return nullptr;
+        pmf = 1;
+        uint32_t at = 0;
+        float u = float(random_double());
+        for (;;) {
+            const Node& node = nodes[at];
+            if (node.leaf) return importance(node.bounds, p, n) > 0 ? lights[node.index].object.get() : nullptr;
+            float a = importance(nodes[at + 1].bounds, p, n), b = importance(nodes[node.index].bounds, p, n);
+            if (a + b <= 0) return nullptr;
+            float pa = a / (a + b);
+            if (u < pa) {
+                u = std::min(u / pa, 0.99999994f);
+                pmf *= pa;
+                at = at + 1;
+            }
+            else {
+                u = std::min((u - pa) / (1 - pa), 0.99999994f);
+                pmf *= 1 - pa;
+                at = node.index;
+            }
+        }
+    }
+
+    // chance that pick(p, n) returns `light`, 0 for objects that aren't in here
+    float pmf(const Vec3& p, const Vec3& n, const Object* light) const noexcept
+    {
+        auto it = index.find(light);
+        if (it == index.end()) return 0;
+        const Light& l = lights[it->second];
+        float ret = 1;
+        uint32_t at = 0;
+        for (int depth = 0; !nodes[at].leaf; depth++) {
+            float a = importance(nodes[at + 1].bounds, p, n), b = importance(nodes[nodes[at].index].bounds, p, n);
+            if (a + b <= 0) return 0;
+            bool second = (l.trail >> depth) & 1;
+            ret *= (second ? b : a) / (a + b);
+            at = second ? nodes[at].index : at + 1;
+        }
+        return importance(nodes[at].bounds, p, n) > 0 ? ret : 0;
+    }
+
+    // upper bound on what lights inside `b` can send to p on a surface facing n
+    static float importance(const LightBounds& b, const Vec3& p, const Vec3& n) noexcept
+    {
+        Vec3 center = 0.5f * (b.lo + b.hi);
+        Vec3 d = p - center;
+        float radius = 0.5f * (b.hi - b.lo).length();
+        // don't blow up for points inside or very close to the bounds
+        float dist2 = std::max(d.squared_length(), radius * radius);
+        float dist = std::sqrt(d.squared_length());
+        if (dist <= 0) return b.power / dist2;
+        Vec3 w = d / dist;
+
+        // angle the bounds cover as seen from p
+        float sinB = std::min(radius / dist, 1.0f);
+        float thetaB = dist <= radius ? float(PI) : std::asin(sinB);
+
+        // from the light's normals to p, less the normals' spread and the bounds
+        float cosW = dot(b.axis, w);
+        if (b.twoSided) cosW = std::fabs(cosW);
+        float thetaW = std::acos(std::clamp(cosW, -1.0f, 1.0f));
+        float thetaO = std::acos(std::clamp(b.cosThetaO, -1.0f, 1.0f));
+        float thetaE = std::acos(std::clamp(b.cosThetaE, -1.0f, 1.0f));
+        float theta = std::max(0.0f, thetaW - thetaO - thetaB);
+        if (theta >= thetaE) return 0;
+
+        // and from p's normal to the light
+        float thetaI = std::acos(std::clamp(dot(n, -w), -1.0f, 1.0f));
+        float cosI = std::cos(std::max(0.0f, thetaI - thetaB));
+        if (cosI <= 0) return 0;
+        return b.power * std::cos(theta) * cosI / dist2;
+    }
+
+    size_t memoryBytes() const noexcept
+    {
+        return nodes.size() * sizeof(Node) + lights.size() * sizeof(Light);
+    }
+
+private:
+    struct Light
+    {
+        std::shared_ptr<Object> object;
+        LightBounds bounds;
+        uint64_t trail; // bit d set: take the second child at depth d
+    };
+
+    // depth-first order: an inner node's first child follows it, `index` is
+    // the second child, or the light for a leaf
+    struct Node
+    {
+        LightBounds bounds;
+        uint32_t index = 0;
+        bool leaf = false;
+    };
+
+    uint32_t build(std::vector<uint32_t>& order, size_t begin, size_t end, uint64_t trail, int depth)
+    {
+        auto at = uint32_t(nodes.size());
+        nodes.emplace_back();
+        LightBounds bounds = lights[order[begin]].bounds;
+        for (size_t i = begin + 1; i < end; i++) bounds = merge(bounds, lights[order[i]].bounds);
+        nodes[at].bounds = bounds;
+
+        // median splits keep the depth, and so the trail, under 64
+        if (end - begin == 1) {
+            nodes[at].leaf = true;
+            nodes[at].index = order[begin];
+            lights[order[begin]].trail = trail;
+            return at;
+        }
+
+        // median along the widest axis of the light centres
+        Vec3 clo = center(lights[order[begin]].bounds), chi = clo;
+        for (size_t i = begin + 1; i < end; i++) {
+            clo = vmin(clo, center(lights[order[i]].bounds));
+            chi = vmax(chi, center(lights[order[i]].bounds));
+        }
+        Vec3 extent = chi - clo;
+        int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+        size_t mid = (begin + end) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+            [&](uint32_t a, uint32_t b) { return center(lights[a].bounds)[axis] < center(lights[b].bounds)[axis]; });
+
+        build(order, begin, mid, trail, depth + 1);
+        uint32_t second = build(order, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+        nodes[at].index = second;
+        return at;
+    }
+
+    static Vec3 center(const LightBounds& b) noexcept { return 0.5f * (b.lo + b.hi); }
+
+    static LightBounds merge(const LightBounds& a, const LightBounds& b) noexcept
+    {
+        LightBounds ret;
+        ret.lo = vmin(a.lo, b.lo);
+        ret.hi = vmax(a.hi, b.hi);
+        ret.power = a.power + b.power;
+        ret.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+        ret.twoSided = a.twoSided || b.twoSided;
+        mergeCones(a.axis, a.cosThetaO, b.axis, b.cosThetaO, ret.axis, ret.cosThetaO);
+        return ret;
+    }
+
+    // smallest cone around both cones
+    static void mergeCones(Vec3 a, float cosA, Vec3 b, float cosB, Vec3& axis, float& cosTheta) noexcept
+    {
+        float thetaA = std::acos(std::clamp(cosA, -1.0f, 1.0f)), thetaB = std::acos(std::clamp(cosB, -1.0f, 1.0f));
+        if (thetaB > thetaA) {
+            std::swap(a, b);
+            std::swap(thetaA, thetaB);
+        }
+        float thetaD = std::acos(std::clamp(dot(a, b), -1.0f, 1.0f));
+        if (std::min(thetaD + thetaB, float(PI)) <= thetaA) {
+            axis = a;
+            cosTheta = std::cos(thetaA);
+            return;
+        }
+        float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+        if (thetaO >= float(PI)) {
+            axis = a;
+            cosTheta = -1;
+            return;
+        }
+        // turn a towards b until the cone reaches both
+        float thetaR = thetaO - thetaA;
+        Vec3 towards = b - dot(a, b) * a;
+        float len = towards.length();
+        axis = len > 0 ? unit_vector(std::cos(thetaR) * a + std::sin(thetaR) * (towards / len)) : a;
+        cosTheta = std::cos(thetaO);
+    }
+
+    std::vector<Light> lights;
+    std::vector<Node> nodes;
+    std::unordered_map<const Object*, uint32_t> index;
+};
+
+inline std::shared_ptr<LightBVH> ObjectGroup::to_light_bvh() const
+{
+    return std::make_shared<LightBVH>(objects);
+}
@@ -0,0 +1,150 @@
+#pragma once
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Memory mapping of a whole file. Pages are loaded by the OS on first touch
+// and, being file-backed, can be dropped again under memory pressure, so
+// mapping a file much larger than RAM is fine. Writable mappings are made
+// with the (path, size) constructor; release() writes a range back and
+// drops it from memory right away instead of waiting for the OS.
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path)
+    {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            FILE_FLAG_RANDOM_ACCESS, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("cannot open " + path);
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        length = size_t(fileSize.QuadPart);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            CloseHandle(file);
+            throw std::runtime_error("cannot map " + path);
+        }
+        ptr = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("cannot open " + path);
+        struct stat st {};
+        fstat(fd, &st);
+        length = size_t(st.st_size);
+        void* p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        ptr = p == MAP_FAILED ? nullptr : static_cast<unsigned char*>(p);
+        if (ptr)
+            madvise(p, length, MADV_RANDOM);
+#endif
+        if (!ptr) {
+            close();
+            throw std::runtime_error("cannot map " + path);
+        }
+    }
+
+    // creates (or truncates) the file at `size` bytes and maps it read-write
+    MappedFile(const std::string& path, size_t size) : length(size)
+    {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("cannot create " + path);
+        LARGE_INTEGER fileSize;
+        fileSize.QuadPart = LONGLONG(size);
+        if (!SetFilePointerEx(file, fileSize, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+            close();
+            throw std::runtime_error("cannot resize " + path);
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+        if (mapping)
+            ptr = static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0));
+#else
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("cannot create " + path);
+        if (ftruncate(fd, off_t(size)) != 0) {
+            close();
+            throw std::runtime_error("cannot resize " + path);
+        }
+        void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ptr = p == MAP_FAILED ? nullptr : static_cast<unsigned char*>(p);
+#endif
+        if (!ptr) {
+            close();
+            throw std::runtime_error("cannot map " + path);
+        }
+        writable = true;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    const unsigned char* data() const noexcept { return ptr; }
+    unsigned char* writableData() noexcept { return writable ? ptr : nullptr; }
+    size_t size() const noexcept { return length; }
+
+    static size_t pageSize() noexcept
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        return size_t(sysconf(_SC_PAGESIZE));
+#endif
+    }
+
+    // writes [offset, offset + bytes) back to the file and drops it from memory;
+    // offset must be page aligned and nobody may still be writing to the range
+    void release(size_t offset, size_t bytes) noexcept
+    {
+        if (!bytes) return;
+#ifdef _WIN32
+        if (writable) FlushViewOfFile(ptr + offset, bytes);
+        // unlocking pages that were never locked takes them out of the working set
+        VirtualUnlock(ptr + offset, bytes);
+#else
+        if (writable) msync(ptr + offset, bytes, MS_SYNC);
+        madvise(ptr + offset, bytes, MADV_DONTNEED);
+#endif
+    }
+
+private:
+    void close() noexcept
+    {
+#ifdef _WIN32
+        if (ptr) UnmapViewOfFile(ptr);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (ptr) munmap(ptr, length);
+        if (fd >= 0) ::close(fd);
+#endif
+        ptr = nullptr;
+    }
+
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+    unsigned char* ptr = nullptr;
+    size_t length = 0;
+    bool writable = false;
+};
@@ -1,8 +1,12 @@
 #pragma once
+#include <string>
+#include <typeinfo>
+#include "hash.h"
 #include "ray.h"
 #include "hit_info.h"
 #include "vec3.h"
 #include "texture.h"
+#include "texture_cache.h"
 
 static Vec3 reflect(const Vec3& v, const Vec3& n) {
     return v - 2 * dot(v, n) * n;
@@ -25,6 +29,21 @@ static float schlick(float cosine, float ref_idx) {
     return r0 + (1 - r0) * pow((1 - cosine), 5);
 }
 
+// what a scene needs from the integrator, see Kernel in renderer.h
+struct SceneFeatures
+{
+    bool emissive = false;      // some material emits light
+    bool imageTextures = false; // some material does filtered texture lookups
+
+    static SceneFeatures all() noexcept { return SceneFeatures{ true, true }; }
+    SceneFeatures& operator|=(const SceneFeatures& other) noexcept
+    {
+        emissive |= other.emissive;
+        imageTextures |= other.imageTextures;
+        return *this;
+    }
+};
+
 class Material {
 public:
     virtual ~Material() {}
@@ -34,22 +53,49 @@ public:
     virtual Vec3 emitted(float u, float v, const Vec3& p) const {
         return Vec3(0, 0, 0);
     }
+    // surface colour without lighting, written to the albedo feature buffer
+    virtual Vec3 baseColor(const HitInfo& rec) const {
+        return Vec3(1, 1, 1);
+    }
+    virtual SceneFeatures features() const noexcept { return {}; }
+    // Lambertian: scatters with cosine/pi times baseColor(), which path guiding relies on
+    virtual bool diffuse() const noexcept { return false; }
+    // the type and every parameter that changes how it looks, for cache keys
+    virtual void hash(Hasher& h) const { h.add(std::string(typeid(*this).name())); }
 };
 
 class Lambertian : public Material {
 public:
-    Lambertian(std::shared_ptr<Texture> texture) : texture(std::move(texture)) {}
+    Lambertian(std::shared_ptr<Texture> texture)
+        : texture(std::move(texture)), image(std::dynamic_pointer_cast<ImageTexture>(this->texture)) {}
 
     bool scatter(const Ray& r_in, const HitInfo& rec,
         Vec3& attenuation, Ray& scattered) const override
     {
-        Vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-        scattered = Ray(rec.p, target - rec.p);
-        attenuation = texture->value(0, 0, rec.p);
+        scattered = Ray(rec.p, random_cosine_direction(rec.normal));
+        scattered.spread = DiffuseSpread;
+        attenuation = baseColor(rec);
         return true;
     }
+    Vec3 baseColor(const HitInfo& rec) const override {
+        if (image)
+            return image->lookup(rec.u, rec.v, rec.footprint / rec.uvScale);
+        return texture->value(rec.u, rec.v, rec.p);
+    }
+    SceneFeatures features() const noexcept override {
+        return SceneFeatures{ false, image != nullptr };
+    }
+    bool diffuse() const noexcept override { return true; }
+    void hash(Hasher& h) const override {
+        Material::hash(h);
+        texture->hash(h);
+    }
+
+    // diffuse bounces scatter widely, so their texture lookups can use coarse mips
+    static constexpr float DiffuseSpread = 0.2f;
 
     std::shared_ptr<Texture> texture;
+    std::shared_ptr<ImageTexture> image; // set when texture is an image, for filtered lookups
 };
 
 class Metal : public Material {
@@ -65,6 +111,13 @@ public:
         attenuation = albedo;
         return dot(scattered.direction(), rec.normal) > 0;
     }
+    Vec3 baseColor(const HitInfo& rec) const override {
+        return albedo;
+    }
+    void hash(Hasher& h) const override {
+        Material::hash(h);
+        h.add(albedo).add(fuzziness);
+    }
 
     Vec3 albedo;
     float fuzziness;
@@ -112,6 +165,10 @@ public:
         }
         return true;
     }
+    void hash(Hasher& h) const override {
+        Material::hash(h);
+        h.add(ref_idx);
+    }
 
     float ref_idx;
 };
@@ -126,5 +183,15 @@ public:
     Vec3 emitted(float u, float v, const Vec3& p) const override {
         return emit->value(u, v, p);
     }
+    Vec3 baseColor(const HitInfo& rec) const override {
+        return emit->value(rec.u, rec.v, rec.p);
+    }
+    SceneFeatures features() const noexcept override {
+        return SceneFeatures{ true, false };
+    }
+    void hash(Hasher& h) const override {
+        Material::hash(h);
+        emit->hash(h);
+    }
     std::shared_ptr<Texture> emit;
 };
@@ -0,0 +1,224 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "objects.h"
+#include "wide_bvh.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// NUMA node the current thread was pinned to, 0 if it wasn't
+inline thread_local int currentNumaNode = 0;
+
+// CPUs of each NUMA node. Machines (or platforms) we can't query come out as
+// one node holding every hardware thread. On Linux only the CPUs the process
+// may run on (taskset, cpusets) are kept, and nodes left without any are dropped.
+struct NumaTopology
+{
+    std::vector<std::vector<int>> cpus;
+
+    static NumaTopology detect()
+    {
+        NumaTopology ret;
+#ifdef _WIN32
+        ULONG highest = 0;
+        if (GetNumaHighestNodeNumber(&highest)) {
+            for (USHORT node = 0; node <= highest; node++) {
+                GROUP_AFFINITY affinity{};
+                if (!GetNumaNodeProcessorMaskEx(node, &affinity)) continue;
+                std::vector<int> list;
+                for (int bit = 0; bit < 64; bit++)
+                    if (affinity.Mask & (KAFFINITY(1) << bit))
+                        list.push_back(affinity.Group * 64 + bit);
+                if (!list.empty()) ret.cpus.push_back(list);
+            }
+        }
+#elif defined(__linux__)
+        cpu_set_t allowed;
+        bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+        auto isAllowed = [&](int cpu) { return !restricted || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)); };
+        for (int node = 0;; node++) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) break;
+            std::string line;
+            std::getline(file, line);
+            auto list = parseCpuList(line);
+            list.erase(std::remove_if(list.begin(), list.end(), [&](int cpu) { return !isAllowed(cpu); }), list.end());
+            if (!list.empty()) ret.cpus.push_back(list);
+        }
+        if (ret.cpus.empty() && restricted) {
+            ret.cpus.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &allowed)) ret.cpus[0].push_back(cpu);
+        }
+#endif
+        if (ret.cpus.empty()) {
+            ret.cpus.emplace_back();
+            for (int cpu = 0; cpu < int(std::max(1u, std::thread::hardware_concurrency())); cpu++)
+                ret.cpus[0].push_back(cpu);
+        }
+        return ret;
+    }
+
+    int nodes() const noexcept { return int(cpus.size()); }
+
+    int threads() const noexcept
+    {
+        int n = 0;
+        for (auto& list : cpus) n += int(list.size());
+        return n;
+    }
+
+    // workers are dealt to nodes in turn, so a partial pool still uses every socket
+    int nodeOf(size_t worker) const noexcept { return int(worker % cpus.size()); }
+    int cpuOf(size_t worker) const noexcept
+    {
+        auto& list = cpus[nodeOf(worker)];
+        return list[(worker / cpus.size()) % list.size()];
+    }
+
+    // pins the calling thread to the worker's CPU and records its node;
+    // false if the OS refused, the node is still recorded
+    bool pinWorker(size_t worker) const noexcept
+    {
+        currentNumaNode = nodeOf(worker);
+        return pinThread(cpuOf(worker));
+    }
+
+    static bool pinThread(int cpu) noexcept
+    {
+#ifdef _WIN32
+        GROUP_AFFINITY affinity{};
+        affinity.Group = WORD(cpu / 64);
+        affinity.Mask = KAFFINITY(1) << (cpu % 64);
+        return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr) != 0;
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // "0-3,8-11" -> 0 1 2 3 8 9 10 11
+    static std::vector<int> parseCpuList(const std::string& text)
+    {
+        std::vector<int> ret;
+        std::stringstream ss(text);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            if (item.find_first_of("0123456789") == std::string::npos) continue;
+            auto dash = item.find('-');
+            int first = std::stoi(item.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) ret.push_back(cpu);
+        }
+        return ret;
+    }
+};
+
+// One copy of the wide BVH's node and primitive arrays per NUMA node, each
+// copied by a thread pinned to that node so first touch puts its pages in
+// local memory. Lookups go to the copy of the node the calling thread was
+// pinned to. The primitives and materials themselves are shared.
+class ReplicatedBVH : public Object
+{
+public:
+    ReplicatedBVH(std::shared_ptr<WideBVH> bvh, const NumaTopology& topology)
+    {
+        replicas.resize(topology.nodes());
+        replicas[0] = std::move(bvh);
+        for (int node = 1; node < topology.nodes(); node++) {
+            std::thread([&, node]() {
+                NumaTopology::pinThread(topology.cpus[node][0]);
+                replicas[node] = std::make_shared<WideBVH>(*replicas[0]);
+            }).join();
+        }
+    }
+
+    [[nodiscard]] std::optional<HitInfo> hit(const Ray& r, float t_min, float t_max) const noexcept override
+    {
+        return replicas[std::min(size_t(currentNumaNode), replicas.size() - 1)]->hit(r, t_min, t_max);
+    }
+    [[nodiscard]] bool bounding_box(AABB& box) const noexcept override { return replicas[0]->bounding_box(box); }
+    [[nodiscard]] SceneFeatures features() const noexcept override { return replicas[0]->features(); }
+
+private:
+    std::vector<std::shared_ptr<WideBVH>> replicas;
+};
+
+// Tiles split into one queue per NUMA node by horizontal band, so each node
+// mostly writes its own part of the framebuffer. Workers take from their own
+// node's queue and only steal from the others once it is empty.
+class NumaTileQueue
+{
+public:
+    struct Tile { int i_low, i_high, j_low, j_high; };
+
+    NumaTileQueue(int width, int height, int tileSize, int nodes) : queues(std::max(1, nodes))
+    {
+        int tilesY = (height + tileSize - 1) / tileSize;
+        for (int ty = 0; ty < tilesY; ty++) {
+            auto& queue = queues[size_t(ty) * queues.size() / tilesY].tiles;
+            for (int i = 0; i < width; i += tileSize)
+                queue.push_back(Tile{ i, std::min(i + tileSize, width), ty * tileSize, std::min((ty + 1) * tileSize, height) });
+        }
+    }
+
+    // next tile for a worker on `node`, from another node's band if its own is done
+    bool pop(int node, Tile& tile)
+    {
+        for (size_t k = 0; k < queues.size(); k++) {
+            auto& q = queues[(size_t(node) + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.tiles.empty()) continue;
+            tile = q.tiles.front();
+            q.tiles.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+    std::vector<Queue> queues;
+};
+
+// Hands the pages of an all-zero buffer back to the OS, so whichever thread
+// writes them next gets them on its own node. Only does anything on Linux.
+template<class T>
+void releaseForFirstTouch(std::vector<T>& buffer) noexcept
+{
+#if defined(__linux__)
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    auto begin = reinterpret_cast<uintptr_t>(buffer.data());
+    auto end = begin + buffer.size() * sizeof(T);
+    begin = (begin + page - 1) / page * page;
+    end = end / page * page;
+    if (end > begin)
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+#endif
+}
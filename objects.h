@@ -1,20 +1,71 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
 #include <memory>
 #include <optional>
+#include <string>
+#include <typeinfo>
 #include <vector>
+#include "hash.h"
 #include "vec3.h"
 #include "ray.h"
 #include "materials.h"
 #include "hit_info.h"
 #include "aabb.h"
+#include "instrumentation.h"
+#include "camera.h"
+
+// what the light BVH keeps about an emitter, see light_bvh.h
+struct LightBounds
+{
+    Vec3 lo, hi;
+    float power = 0;         // emitted flux, as luminance
+    Vec3 axis{ 0, 0, 1 };    // surface normals lie within theta_o of this...
+    float cosThetaO = -1;
+    float cosThetaE = 0;     // ...and light leaves within theta_e of the normal
+    bool twoSided = false;
+};
+
+// a point on a light picked for a shading point
+struct LightSample
+{
+    Vec3 p;
+    Vec3 radiance;
+    float pdf = 0; // per solid angle, seen from the shading point
+};
 
 class Object
 {
 public:
     [[nodiscard]] virtual std::optional<HitInfo> hit(const Ray& r, float t_min, float t_max) const noexcept = 0;
     [[nodiscard]] virtual bool bounding_box(AABB& box) const noexcept = 0;
+    // used to pick the integrator; objects that don't know ask for everything
+    [[nodiscard]] virtual SceneFeatures features() const noexcept { return SceneFeatures::all(); }
+
+    // Emitters that next-event estimation can aim at describe themselves,
+    // pick points on their surface as seen from `from`, and give the density
+    // of that for a direction that hits them. Everything else returns false / 0.
+    [[nodiscard]] virtual bool lightBounds(LightBounds& bounds) const noexcept { return false; }
+    [[nodiscard]] virtual bool sampleLight(const Vec3& from, LightSample& sample) const noexcept { return false; }
+    [[nodiscard]] virtual float lightPdf(const Vec3& from, const Vec3& dir) const noexcept { return 0; }
+
+    // The type, geometry and material parameters, for cache keys. Objects
+    // that don't say more are known by their type and box.
+    virtual void hash(Hasher& h) const
+    {
+        h.add(std::string(typeid(*this).name()));
+        AABB box;
+        if (bounding_box(box))
+            h.add(box.min()).add(box.max());
+    }
 };
 
+inline float luminance(const Vec3& c) noexcept
+{
+    return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
 class Sphere : public Object
 {
 public:
@@ -23,6 +74,7 @@ public:
 
     [[nodiscard]] std::optional<HitInfo> hit(const Ray& r, float t_min, float t_max) const noexcept override
     {
+        INSTRUMENT_COUNT(primitiveTests);
         Vec3 oc = r.origin() - center;
         float a = dot(r.direction(), r.direction());
         float b = dot(oc, r.direction());
@@ -44,18 +96,86 @@ public:
             center + Vec3(radius, radius, radius));
         return true;
     }
+    [[nodiscard]] SceneFeatures features() const noexcept override { return material->features(); }
+    void hash(Hasher& h) const override
+    {
+        h.add(std::string(typeid(*this).name())).add(center).add(radius);
+        material->hash(h);
+    }
+
+    [[nodiscard]] bool lightBounds(LightBounds& bounds) const noexcept override {
+        if (!material->features().emissive) return false;
+        float u, v;
+        uvOf(Vec3(0, 1, 0), u, v);
+        Vec3 r(radius, radius, radius);
+        bounds = LightBounds{ center - r, center + r,
+            luminance(material->emitted(u, v, center)) * 4 * float(PI * PI) * radius * radius };
+        return bounds.power > 0;
+    }
+    // uniform over the cone the sphere covers, from outside it only
+    [[nodiscard]] bool sampleLight(const Vec3& from, LightSample& sample) const noexcept override {
+        Vec3 w = center - from;
+        float dist2 = w.squared_length();
+        if (dist2 <= radius * radius) return false;
+        float dist = std::sqrt(dist2);
+        w /= dist;
+        float oneMinusCosMax = coneSize(dist2);
+        float cosTheta = 1 - float(random_double()) * oneMinusCosMax;
+        float sinTheta = std::sqrt(std::max(0.0f, 1 - cosTheta * cosTheta));
+        float phi = 2 * float(PI) * float(random_double());
+        Vec3 a = std::fabs(w.x()) > 0.9f ? Vec3(0, 1, 0) : Vec3(1, 0, 0);
+        Vec3 t = unit_vector(cross(a, w)), b = cross(w, t);
+        Vec3 dir = std::cos(phi) * sinTheta * t + std::sin(phi) * sinTheta * b + cosTheta * w;
+        // nearest intersection, or the tangent point when rounding misses it
+        float proj = dist * cosTheta;
+        float t0 = proj - std::sqrt(std::max(0.0f, radius * radius - (dist2 - proj * proj)));
+        sample.p = from + t0 * dir;
+        float u, v;
+        uvOf((sample.p - center) / radius, u, v);
+        sample.radiance = material->emitted(u, v, sample.p);
+        sample.pdf = 1 / (2 * float(PI) * oneMinusCosMax);
+        return true;
+    }
+    [[nodiscard]] float lightPdf(const Vec3& from, const Vec3& dir) const noexcept override {
+        float dist2 = (center - from).squared_length();
+        if (dist2 <= radius * radius) return 0;
+        return 1 / (2 * float(PI) * coneSize(dist2));
+    }
+
     Vec3 center;
     float radius;
     std::shared_ptr<Material> material;
 private:
+    // 1 - cos of the cone's half angle, without the cancellation that makes
+    // it 0 for small or far spheres
+    float coneSize(float dist2) const noexcept
+    {
+        float sin2 = radius * radius / dist2;
+        return sin2 / (1 + std::sqrt(1 - sin2));
+    }
+
+    static void uvOf(const Vec3& n, float& u, float& v) noexcept
+    {
+        u = 1 - (atan2(n.z(), n.x()) + float(PI)) / (2 * float(PI));
+        v = (asin(std::max(-1.0f, std::min(1.0f, n.y()))) + float(PI) / 2) / float(PI);
+    }
+
     HitInfo createHitInfo(const Ray& r, float t) const noexcept
     {
         auto p = r.point_at_parameter(t);
-        return HitInfo{ t, p ,(p - center) / radius, material };
+        Vec3 n = (p - center) / radius;
+        float u, v;
+        uvOf(n, u, v);
+        HitInfo ret{ t, p, n, material, u, v, 2 * float(PI) * radius };
+        ret.object = this;
+        return ret;
     }
 };
 
 class bvh_node;
+class WideBVH;
+class LazyBVHNode;
+class LightBVH;
 class ObjectGroup : public Object
 {
 public:
@@ -94,8 +214,30 @@ public:
         }
         return true;
     }
+    [[nodiscard]] SceneFeatures features() const noexcept override {
+        SceneFeatures ret;
+        for (auto& obj : objects) ret |= obj->features();
+        return ret;
+    }
 
     std::shared_ptr<bvh_node> to_bvh_node();
+    std::shared_ptr<WideBVH> to_wide_bvh() const; // in wide_bvh.h
+    // top levels now, the rest on first hit
+    std::shared_ptr<LazyBVHNode> to_lazy_bvh(int eagerDepth = 4) const; // in lazy_bvh.h
+    // the emitters that can be sampled directly
+    std::shared_ptr<LightBVH> to_light_bvh() const; // in light_bvh.h
+    void hash(Hasher& h) const override
+    {
+        h.add(uint64_t(objects.size()));
+        for (auto& obj : objects) obj->hash(h);
+    }
+    // for cache keys
+    uint64_t contentHash() const
+    {
+        Hasher h;
+        hash(h);
+        return h.value();
+    }
 private:
     std::vector<std::shared_ptr<Object>> objects;
 };
@@ -110,19 +252,19 @@ public:
             AABB box_left, box_right;
             if (!a->bounding_box(box_left) || !b->bounding_box(box_right))
                 std::cerr << "no bounding box in bvh_node constructor\n";
-            return box_left.min().x() - box_right.min().x() < 0.0?-1:1;
+            return box_left.min().x() < box_right.min().x();
         });
         else if (axis == 1) std::sort(l.begin(), l.end(), [](std::shared_ptr<Object> a, std::shared_ptr<Object> b) {
             AABB box_left, box_right;
             if (!a->bounding_box(box_left) || !b->bounding_box(box_right))
                 std::cerr << "no bounding box in bvh_node constructor\n";
-            return box_left.min().y() - box_right.min().y() < 0.0 ? -1 : 1;
+            return box_left.min().y() < box_right.min().y();
             });
         else std::sort(l.begin(), l.end(), [](std::shared_ptr<Object> a, std::shared_ptr<Object> b) {
             AABB box_left, box_right;
             if (!a->bounding_box(box_left) || !b->bounding_box(box_right))
                 std::cerr << "no bounding box in bvh_node constructor\n";
-            return box_left.min().z() - box_right.min().z() < 0.0 ? -1 : 1;
+            return box_left.min().z() < box_right.min().z();
             });
 
         if (l.size() == 1) {
@@ -146,11 +288,16 @@ public:
         }
 
         box = surrounding_box(box_left, box_right);
+        boxMin = box.min();
+        boxMax = box.max();
+        sceneFeatures = left->features();
+        sceneFeatures |= right->features();
     }
 
     [[nodiscard]] std::optional<HitInfo> hit(const Ray& r, float t_min, float t_max) const noexcept override
     {
-        if (box.hit(r, t_min, t_max)) {
+        INSTRUMENT_COUNT(bvhNodesVisited);
+        if (hit_slabs(boxMin, boxMax, r.origin(), r.inv_direction(), t_min, t_max)) {
             auto left_rec = left->hit(r, t_min, t_max), right_rec = right->hit(r, t_min, t_max);
             if (left_rec && right_rec) {
                 if (left_rec->t < right_rec->t)
@@ -168,10 +315,14 @@ public:
         box = this->box;
         return true;
     }
+    [[nodiscard]] SceneFeatures features() const noexcept override { return sceneFeatures; }
 private:
     std::shared_ptr<Object> left;
     std::shared_ptr<Object> right;
     AABB box;
+    // copies of the box corners kept next to each other for hit_slabs
+    Vec3 boxMin, boxMax;
+    SceneFeatures sceneFeatures;
 };
 
 std::shared_ptr<bvh_node> ObjectGroup::to_bvh_node()
@@ -185,6 +336,7 @@ public:
         : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
     [[nodiscard]] std::optional<HitInfo> hit(const Ray& r, float t0, float t1) const noexcept override
     {
+        INSTRUMENT_COUNT(primitiveTests);
         float t = (k - r.origin().z()) / r.direction().z();
         if (t < t0 || t > t1)
             return {};
@@ -192,12 +344,98 @@ public:
         float y = r.origin().y() + t * r.direction().y();
         if (x < x0 || x > x1 || y < y0 || y > y1)
             return {};
-        return HitInfo{ t,r.point_at_parameter(t),{0, 0, 1},mp };
+        HitInfo ret{ t,r.point_at_parameter(t),{0, 0, 1},mp,
+            (x - x0) / (x1 - x0), (y - y0) / (y1 - y0), std::max(x1 - x0, y1 - y0) };
+        ret.object = this;
+        return ret;
     }
     [[nodiscard]] bool bounding_box(AABB& box) const noexcept override {
         box = AABB(Vec3(x0, y0, k - 0.0001), Vec3(x1, y1, k + 0.0001));
         return true;
     }
+    [[nodiscard]] SceneFeatures features() const noexcept override { return mp->features(); }
+    void hash(Hasher& h) const override
+    {
+        h.add(std::string(typeid(*this).name())).add(x0).add(x1).add(y0).add(y1).add(k);
+        mp->hash(h);
+    }
+
+    // emits from both faces
+    [[nodiscard]] bool lightBounds(LightBounds& bounds) const noexcept override {
+        if (!mp->features().emissive) return false;
+        Vec3 mid(0.5f * (x0 + x1), 0.5f * (y0 + y1), k);
+        bounds = LightBounds{ Vec3(x0, y0, k), Vec3(x1, y1, k),
+            luminance(mp->emitted(0.5f, 0.5f, mid)) * area() * 2 * float(PI), Vec3(0, 0, 1), 1, 0, true };
+        return bounds.power > 0;
+    }
+    // uniform over the area
+    [[nodiscard]] bool sampleLight(const Vec3& from, LightSample& sample) const noexcept override {
+        float u = float(random_double()), v = float(random_double());
+        sample.p = Vec3(x0 + u * (x1 - x0), y0 + v * (y1 - y0), k);
+        Vec3 d = sample.p - from;
+        float dist2 = d.squared_length();
+        float cosine = std::fabs(d.z()) / std::sqrt(dist2);
+        if (cosine <= 0) return false;
+        sample.radiance = mp->emitted(u, v, sample.p);
+        sample.pdf = dist2 / (cosine * area());
+        return true;
+    }
+    [[nodiscard]] float lightPdf(const Vec3& from, const Vec3& dir) const noexcept override {
+        float t = (k - from.z()) / dir.z();
+        if (!(t > 0)) return 0;
+        float dist2 = t * t * dir.squared_length();
+        float cosine = std::fabs(dir.z()) / dir.length();
+        return dist2 / (cosine * area());
+    }
+    float area() const noexcept { return (x1 - x0) * (y1 - y0); }
+
     std::shared_ptr<Material> mp;
     float x0, x1, y0, y1, k;
 };
+
+class Triangle : public Object {
+public:
+    Triangle(Vec3 v0, Vec3 v1, Vec3 v2, std::shared_ptr<Material> material)
+        : v0(v0), v1(v1), v2(v2), normal(unit_vector(cross(v1 - v0, v2 - v0))), material(std::move(material)) {}
+
+    // Moller-Trumbore
+    [[nodiscard]] std::optional<HitInfo> hit(const Ray& r, float t_min, float t_max) const noexcept override
+    {
+        INSTRUMENT_COUNT(primitiveTests);
+        Vec3 e1 = v1 - v0, e2 = v2 - v0;
+        Vec3 pvec = cross(r.direction(), e2);
+        float det = dot(e1, pvec);
+        if (std::fabs(det) < 1e-8f)
+            return {};
+        float inv_det = 1.0f / det;
+        Vec3 tvec = r.origin() - v0;
+        float u = dot(tvec, pvec) * inv_det;
+        if (u < 0 || u > 1)
+            return {};
+        Vec3 qvec = cross(tvec, e1);
+        float v = dot(r.direction(), qvec) * inv_det;
+        if (v < 0 || u + v > 1)
+            return {};
+        float t = dot(e2, qvec) * inv_det;
+        if (t < t_min || t > t_max)
+            return {};
+        // barycentrics double as uvs
+        return HitInfo{ t, r.point_at_parameter(t), normal, material, u, v,
+            std::max({ e1.length(), e2.length() }) };
+    }
+    [[nodiscard]] bool bounding_box(AABB& box) const noexcept override {
+        Vec3 lo(std::min({ v0.x(), v1.x(), v2.x() }), std::min({ v0.y(), v1.y(), v2.y() }), std::min({ v0.z(), v1.z(), v2.z() }));
+        Vec3 hi(std::max({ v0.x(), v1.x(), v2.x() }), std::max({ v0.y(), v1.y(), v2.y() }), std::max({ v0.z(), v1.z(), v2.z() }));
+        box = AABB(lo - Vec3(0.0001, 0.0001, 0.0001), hi + Vec3(0.0001, 0.0001, 0.0001));
+        return true;
+    }
+    [[nodiscard]] SceneFeatures features() const noexcept override { return material->features(); }
+    void hash(Hasher& h) const override
+    {
+        h.add(std::string(typeid(*this).name())).add(v0).add(v1).add(v2);
+        material->hash(h);
+    }
+    Vec3 v0, v1, v2;
+    Vec3 normal;
+    std::shared_ptr<Material> material;
+};
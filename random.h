@@ -1,14 +1,67 @@
 #pragma once
-#include <functional>
+#include <atomic>
+#include <cstdint>
 #include <random>
 #include "vec3.h"
 
+// PCG32 (O'Neill): 64 bits of state, one multiply-add per number. Seeding
+// is as cheap as drawing, which seed_sample() needs for every sample.
+class RandomGenerator
+{
+public:
+    using result_type = uint32_t;
+
+    explicit RandomGenerator(uint64_t s = 5489u) noexcept { seed(s); }
+
+    void seed(uint64_t s) noexcept {
+        state = 0;
+        (*this)();
+        state += s;
+        (*this)();
+    }
+
+    result_type operator()() noexcept {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + Increment;
+        auto xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+        auto rot = uint32_t(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    static constexpr result_type min() noexcept { return 0; }
+    static constexpr result_type max() noexcept { return 0xFFFFFFFFu; }
+
+private:
+    static constexpr uint64_t Increment = 1442695040888963407ull;
+    uint64_t state = 0;
+};
+
+// every thread owns its generator; they are seeded from a shared counter so
+// workers never draw the same sequence, and seed_random() makes a run repeatable
+inline unsigned next_random_seed() {
+    static std::atomic<unsigned> counter{ 5489u };
+    return counter.fetch_add(1);
+}
+inline RandomGenerator& random_generator() {
+    thread_local RandomGenerator generator(next_random_seed());
+    return generator;
+}
+inline void seed_random(unsigned seed) {
+    random_generator().seed(seed);
+}
+// reseeds this thread's generator from (seed, x, y, s) alone, so sample s of
+// pixel (x, y) draws the same numbers whichever thread renders it and when
+inline void seed_sample(unsigned seed, unsigned x, unsigned y, unsigned s) {
+    uint64_t h = ((uint64_t(seed) << 32) | x) * 0x9E3779B97F4A7C15ull ^ ((uint64_t(y) << 32) | s);
+    // splitmix64's finaliser, so neighbouring pixels get unrelated seeds
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    h ^= h >> 31;
+    random_generator().seed(h);
+}
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    static std::function<double()> rand_generator =
-        std::bind(distribution, generator);
-    return rand_generator();
+    thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(random_generator());
 }
 inline Vec3 random_in_unit_sphere() {
     Vec3 p;
@@ -17,6 +70,13 @@ inline Vec3 random_in_unit_sphere() {
     } while (p.squared_length() >= 1.0);
     return p;
 }
+// unit direction around the unit normal n with density cosine/pi: a point on
+// the unit sphere sitting on the surface at n
+inline Vec3 random_cosine_direction(const Vec3& n) {
+    Vec3 dir = n + unit_vector(random_in_unit_sphere());
+    float length = dir.length();
+    return length > 1e-6f ? dir / length : n;
+}
 inline Vec3 random_in_unit_disk() {
     Vec3 p;
     do {
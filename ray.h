@@ -5,11 +5,18 @@ class Ray
 {
 public:
     Ray() {}
-    Ray(const Vec3& a, const Vec3& b) { A = a; B = b; }
-    Vec3 origin() const { return A; }
-    Vec3 direction() const { return B; }
-    Vec3 point_at_parameter(float t) const { return A + t * B; }
+    Ray(const Vec3& a, const Vec3& b) { A = a; B = b; InvB = Vec3(1, 1, 1) / b; }
+    const Vec3& origin() const { return A; }
+    const Vec3& direction() const { return B; }
+    // 1 / direction, for the box tests during traversal
+    const Vec3& inv_direction() const { return InvB; }
+    Vec3 point_at_parameter(float t) const { return fmadd(B, Vec3(t, t, t), A); }
 
     Vec3 A;
     Vec3 B;
+    Vec3 InvB;
+    // ray cone for texture filtering: footprint width at the origin and its
+    // growth per unit distance
+    float cone = 0;
+    float spread = 0;
 };
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <optional>
+#include "daemon.h" // first, winsock2.h must come before windows.h
 #include "vec3.h"
 #include "ray.h"
 #include "image.h"
@@ -13,133 +14,102 @@
 #include "threadpool.h"
 #include "window.h"
 #include "shader.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "film.h"
+#include "budget.h"
+#include "denoiser.h"
+#include "display.h"
+#include "animation.h"
+#include "reprojection.h"
+#include "stream_render.h"
+#include "numa.h"
+#include "lazy_bvh.h"
+#include "tile_cache.h"
+#include <string>
+#include <algorithm>
+#include <iterator>
 
 using namespace std;
 
 ObjectGroup scene;
-constexpr int MaxDepth = 50;
 constexpr int Width = 800;
 constexpr int Height = 500;
 int SampleNumber = 10;
 constexpr int TaskBlockSize = 100;
 
+Camera defaultCamera()
+{
+    return Camera{ {2,0.9,-2.5}, {1.6,0.9,-1}, {0, 1, 0}, 90, float(Width) / float(Height), 0.1, 5 };
+}
+
 class MainProgram
 {
 public:
     MainProgram() :w(Width, Height, "ray tracer")
     {
     }
+    ~MainProgram()
+    {
+        // workers write into film, stop them before members go away
+        tp.stop();
+    }
 
     void run() {
         init();
-        w.mainLoop([this]() {render(); });
+        w.mainLoop([this](bool forceRedraw) { return render(forceRedraw); });
     }
 
 private:
-    static std::shared_ptr<Object> generateRandomScene() {
-        int n = 500;
-        ObjectGroup list;
-
-        /*
-        group.addObject<Sphere>(Vec3{ 0, 0, -1 }, .5, lambertian1);
-        group.addObject<Sphere>(Vec3{ 0, -100.5, -1 }, 100, lambertian2);
-        group.addObject<Sphere>(Vec3{ 1, 0, -1 }, .5, metal1);
-        group.addObject<Sphere>(Vec3{ -1, 0, -1 }, .5, dielectric);*/
-        auto l = std::make_shared<Lambertian>(
-            std::make_shared<CheckerTexture>(
-                std::make_shared<ConstantTexture>(Vec3{ 0.2, 0.3, 0.1 }),
-                std::make_shared<ConstantTexture>(Vec3{ 0.9, 0.9, 0.9 })
-            )
-        );
-        list.addObject<Sphere>(Vec3(0, -1000, 0), 1000,l);
-
-        int i = 1;
-        for (int a = -11; a < 11; a++) {
-            for (int b = -11; b < 11; b++) {
-                float choose_mat = random_double();
-                Vec3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-                if ((center - Vec3(4, 0.2, 0)).length() > 0.9) {
-                    if (choose_mat < 0.8) {  // diffuse
-                        list.addObject<Sphere>(center, 0.2, make_shared<Lambertian>(std::make_shared<ConstantTexture>(
-                            Vec3( random_double() * random_double(),
-                            random_double() * random_double(),
-                            random_double() * random_double() ))));
-                    }
-                    else if (choose_mat < 0.95) { // metal
-                        list.addObject<Sphere>(center, 0.2, make_shared<Metal>(Vec3(0.5 * (1 + random_double()),
-                            0.5 * (1 + random_double()),
-                            0.5 * (1 + random_double())),
-                            0.5 * random_double()));
-                    }
-                    else {  // glass
-                        list.addObject<Sphere>(center, 0.2, make_shared<Dielectric>(1.5));
-                    }
-                }
-            }
-        }
-
-        list.addObject<Sphere>(Vec3{ 0, 1, 0 }, 1.0, make_shared<Dielectric>(1.5));
-        list.addObject<Sphere>(Vec3{ -4, 1, 0 }, 1.0, make_shared<Lambertian>(std::make_shared<ConstantTexture>(Vec3{ 0.4, 0.2, 0.1 })));
-        list.addObject<Sphere>(Vec3{ 4, 1, 0 }, 1.0, make_shared<Metal>(Vec3{ 0.7, 0.6, 0.5 }, 0.0));
-
-        list.addObject<XYRect>(0, 2, 0, 1, 2,
-            make_shared<DiffuseLight>(make_shared<ConstantTexture>(Vec3(0, 1, 1))));
-
-        return list.to_bvh_node();
-    }
-    static Vec3 color(const Ray& r, Object& world, int depth) {
-        if (auto info = world.hit(r, 0.001, std::numeric_limits<float>::max());
-            info) {
-
-            Ray scattered;
-            Vec3 attenuation;
-            Vec3 emitted = info->material->emitted(0, 0, info->p);
-
-            if (depth < MaxDepth && info->material->scatter(r, *info, attenuation, scattered)) {
-                return  emitted + attenuation * color(scattered, world, depth + 1);
-            }
-            return emitted;
-
-        }
-        float t = 0.5 * (unit_vector(r.direction()).y() + 1.0);
-        return (1.0 - t) * Vec3(1.0, 1.0, 1.0) + t * Vec3(0.5, 0.7, 1.0);
-    }
-
     void renderTask(int i_low, int i_high, int j_low, int j_high)
     {
-        for(int i=i_low;i<i_high;i++)
-        {
-            for (int j = j_low; j < j_high; j++)
-            {
-                Vec3 col = { 0,0,0 };
-
-                for (int s = 0; s < SampleNumber; s++) {
-                    float u = float(i + random_double()) / float(img.width);
-                    float v = float(j + random_double()) / float(img.height);
-                    col += color(camera.getRay(u, v), *group, 0);
-                }
-                col /= SampleNumber;
-                col = Vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
-
-                img.getPixel(i, j).setPixel(col * 255.99);
-            }
-        }
+        accumulateTile(film, camera, *group, SampleNumber, i_low, i_high, j_low, j_high);
+        display.markDirty(i_low, j_low);
     }
 
     void startRaytracing()
     {
         cout << "Starting new ray tracing... from "<<camera.lookfrom << " to " <<camera.lookat << " with SampleNumber = " << SampleNumber << endl;
         tp.stop();
-        //img.clear();
-
-        for (int j = img.height; j >= 0; j -= TaskBlockSize) {
-            for (int i = 0; i < img.width; i += TaskBlockSize) {
-                auto task = [this, i, j]() {
-                    renderTask(i, min(i + TaskBlockSize, int(img.width)),
-                        max(j - TaskBlockSize, 0), j);
-                };
-                tp.addTask(task);
-            }
+        std::vector<bool> holes;
+        if (reprojection) {
+            // keep what we have, seen from the new camera, until fresh samples replace it
+            holes = reproject(film, renderedCamera, camera);
+            // shown now, before workers write into the film again; from then
+            // on only renderTask marks tiles
+            display.markAllDirty();
+            display.upload(film);
+        }
+        else {
+            // show what the old workers finished before their samples are dropped
+            display.upload(film);
+            film.clear();
+        }
+        renderedCamera = camera;
+#ifdef RAYTRACER_INSTRUMENT
+        Instrumentation::instance().reset(img.width, img.height);
+#endif
+
+        // top rows first; tiles are aligned to the display's tile grid
+        std::vector<std::pair<int, int>> tiles;
+        for (int j = (int(img.height) - 1) / TaskBlockSize * TaskBlockSize; j >= 0; j -= TaskBlockSize)
+            for (int i = 0; i < int(img.width); i += TaskBlockSize)
+                tiles.emplace_back(i, j);
+        // then move tiles with disoccluded pixels to the front
+        if (!holes.empty()) {
+            std::stable_partition(tiles.begin(), tiles.end(), [&](const std::pair<int, int>& tile) {
+                for (int y = tile.second; y < min(tile.second + TaskBlockSize, int(img.height)); y++)
+                    for (int x = tile.first; x < min(tile.first + TaskBlockSize, int(img.width)); x++)
+                        if (holes[y * img.width + x]) return true;
+                return false;
+            });
+        }
+        for (auto [i, j] : tiles) {
+            auto task = [this, i = i, j = j]() {
+                renderTask(i, min(i + TaskBlockSize, int(img.width)),
+                    j, min(j + TaskBlockSize, int(img.height)));
+            };
+            tp.addTask(task);
         }
 
         tp.start(std::thread::hardware_concurrency() - 1);
@@ -151,24 +121,23 @@ private:
         auto lambertian2 = make_shared<Lambertian>(std::make_shared<ConstantTexture>(Vec3{ 0.8, 0.8, 0.0 }));
         auto metal1 = make_shared<Metal>(Vec3(0.8, 0.6, 0.2), 0.0);
         auto dielectric = make_shared<Dielectric>(1.5);
-        group = generateRandomScene();
+        // subtrees the camera never sees aren't built
+        group = generateRandomScene().to_lazy_bvh();
         startRaytracing();
     }
 
-    void render()
+    bool render(bool forceRedraw)
     {
-        glClearColor(0, 0, 0, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-        //glRasterPos2i(0, 0);
-        glDrawPixels(Width, Height, GL_RGB, GL_UNSIGNED_BYTE, img.getBuffer());
-
-        glFlush();
-
         auto keys = SDL_GetKeyboardState(nullptr);
         if (keys[SDL_SCANCODE_Q]) {
+            film.toImage(img);
             writeImage(ofstream("img.ppm"), img);
             cout << "Image saved" << endl;;
+#ifdef RAYTRACER_INSTRUMENT
+            Instrumentation::instance().writeHeatmap(ofstream("img_heatmap.ppm"));
+            Instrumentation::instance().writeTrace(ofstream("img_trace.json"));
+            Instrumentation::instance().report(cout);
+#endif
         }
         auto speed = 0.05f;
         if (keys[SDL_SCANCODE_LEFT]) {
@@ -220,21 +189,282 @@ private:
             SampleNumber = max(1, SampleNumber);
             startRaytracing();
         }
+        if (keys[SDL_SCANCODE_T] && !toggleHeld) {
+            display.reinhard = !display.reinhard;
+            forceRedraw = true;
+        }
+        toggleHeld = keys[SDL_SCANCODE_T];
+        if (keys[SDL_SCANCODE_R] && !reprojectionHeld) {
+            reprojection = !reprojection;
+            cout << "Reprojection " << (reprojection ? "on" : "off") << endl;
+        }
+        reprojectionHeld = keys[SDL_SCANCODE_R];
+        if (keys[SDL_SCANCODE_LEFTBRACKET] || keys[SDL_SCANCODE_RIGHTBRACKET]) {
+            display.exposure *= keys[SDL_SCANCODE_LEFTBRACKET] ? 0.97f : 1.03f;
+            forceRedraw = true;
+        }
         pb.flush(tp.getCounter());
+
+        if (!display.upload(film) && !forceRedraw)
+            return false;
+        glClearColor(0, 0, 0, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        display.draw();
+        return true;
     }
 
     Window w;
+    FilmDisplay display{ Width, Height, TaskBlockSize }; // needs the window's GL context
     std::shared_ptr<Object> group;
     ThreadPool tp;
+    Film film{ Width, Height };
     Image img{ Width, Height };
-    Camera camera{ {2,0.9,-2.5}, {1.6,0.9,-1}, {0, 1, 0}, 90, float(img.width) / float(img.height), 0.1, 5 };
+    bool toggleHeld = false;
+    bool reprojection = true, reprojectionHeld = false;
+    Camera camera = defaultCamera();
+    Camera renderedCamera = camera; // what the film was rendered from
     ProgressBar pb{ Width * Height, 80 };
 };
 
 
-int main()
+struct HeadlessOptions
 {
+    double budget = 0;     // seconds; 0 renders a fixed SampleNumber instead
+    int spp = 0;
+    bool denoise = false;
+    bool features = false; // also write the albedo/normal/depth buffers
+    string output = "img.ppm";
+    string texture;        // PPM shown on the textured scene instead of the random one
+    size_t textureCacheMB = 0;
+    string animation;      // camera path file; renders a frame sequence instead
+    float fps = 24;
+    size_t streamWidth = 0, streamHeight = 0; // render straight to disk at this size
+    bool numa = false;     // pin workers, one BVH copy per NUMA node, node-local tiles
+    bool guide = false;    // learn where light comes from and steer diffuse bounces there
+    bool nee = false;      // sample lights directly through a light BVH
+    string scene = "random";
+    string cache;          // tile cache directory; fixed-spp renders load and extend what is there
+    size_t cacheMB = 1024;
+    unsigned seed = 0;     // sampler seed of cached renders
+};
+
+// renders without a window and saves the result
+void renderHeadless(const HeadlessOptions& options)
+{
+    if (options.textureCacheMB)
+        TextureCache::instance().setCapacity(options.textureCacheMB << 20);
+    if (!namedScenes().count(options.scene))
+        throw invalid_argument("unknown scene " + options.scene);
+    if (!options.texture.empty() && options.scene != "random")
+        throw invalid_argument("--texture renders its own scene and can't be combined with --scene");
+    // the guide learns between the passes of a fixed-spp render, which the
+    // other modes don't have
+    if (options.guide && (!options.animation.empty() || options.streamWidth || options.budget > 0 || options.numa))
+        throw invalid_argument("--guide can't be combined with --animate, --stream, --budget or --numa");
+    // only the fixed-spp render goes through the tile cache
+    if (!options.cache.empty() && (!options.animation.empty() || options.streamWidth || options.budget > 0 || options.numa))
+        throw invalid_argument("--cache can't be combined with --animate, --stream, --budget or --numa");
+    ObjectGroup scene = options.texture.empty()
+        ? namedScenes().at(options.scene)() : generateTexturedScene(ImageTexture::load(options.texture));
+    NumaTopology topology = NumaTopology::detect();
+    std::shared_ptr<Object> world;
+    if (options.numa)
+        world = std::make_shared<ReplicatedBVH>(scene.to_wide_bvh(), topology);
+    else
+        world = scene.to_bvh_node();
+    int threads = int(std::max(1u, std::thread::hardware_concurrency()));
+    std::shared_ptr<LightBVH> lights;
+    if (options.nee) {
+        lights = scene.to_light_bvh();
+        cout << lights->size() << " lights for next-event estimation" << endl;
+    }
+
+    if (!options.animation.empty()) {
+        CameraPath path = CameraPath::load(options.animation);
+        AnimationSettings settings;
+        settings.width = Width;
+        settings.height = Height;
+        settings.spp = options.spp;
+        settings.fps = options.fps;
+        settings.stem = options.output.substr(0, options.output.rfind('.'));
+        int frames = AnimationRenderer{ *world, path, settings, threads, lights.get() }.render();
+        cout << frames << " frames written to " << settings.stem << "_*.ppm" << endl;
+        return;
+    }
+
+    Camera camera = defaultCamera();
+    if (options.streamWidth) {
+        camera.aspect = float(options.streamWidth) / float(options.streamHeight);
+        camera.calculate();
+        StreamRenderer{ *world, camera, options.output, options.streamWidth, options.streamHeight, threads, lights.get() }
+            .render(options.spp);
+        cout << options.streamWidth << "x" << options.streamHeight << " written to " << options.output << endl;
+        return;
+    }
+
+    Film film{ Width, Height };
+
+    if (options.budget > 0) {
+        BudgetRenderer renderer{ *world, camera, film, threads, lights.get() };
+        int rounds = renderer.render(options.budget);
+        size_t total = 0;
+        for (auto n : film.samples) total += n;
+        cout << "Budget of " << options.budget << "s spent in " << rounds << " rounds, "
+            << double(total) / film.samples.size() << " samples per pixel on average" << endl;
+    }
+    else if (options.numa) {
+        for (auto* buffer : { &film.sum, &film.albedoSum, &film.normalSum })
+            releaseForFirstTouch(*buffer);
+        releaseForFirstTouch(film.sumLumSq);
+        releaseForFirstTouch(film.depthSum);
+        releaseForFirstTouch(film.samples);
+        cout << "Rendering on " << topology.nodes() << " NUMA node(s)" << endl;
+
+        NumaTileQueue tiles{ Width, Height, TaskBlockSize, topology.nodes() };
+        ThreadPool pool;
+        pool.onWorkerStart([&](size_t worker) {
+            if (!topology.pinWorker(worker)) {
+                static std::mutex logMutex;
+                std::lock_guard<std::mutex> lock(logMutex);
+                cerr << "Couldn't pin worker " << worker << " to CPU " << topology.cpuOf(worker)
+                    << ", it runs unpinned" << endl;
+            }
+        });
+        for (int w = 0; w < threads; w++) {
+            // every worker drains tiles, its own node's band first
+            pool.addTask([&]() {
+                NumaTileQueue::Tile tile;
+                while (tiles.pop(currentNumaNode, tile))
+                    accumulateTile(film, camera, *world, options.spp, tile.i_low, tile.i_high, tile.j_low, tile.j_high,
+                        nullptr, lights.get());
+            });
+        }
+        pool.start(threads);
+        pool.join();
+    }
+    else if (!options.cache.empty()) {
+        if (options.guide)
+            throw invalid_argument("--guide renders depend on what the guide learnt and can't be cached");
+        uint64_t sceneHash = scene.contentHash();
+        TileCache cache{ options.cache, options.cacheMB << 20 };
+        uint64_t key = renderKey(sceneHash, camera, options.seed, Width, Height, options.nee);
+        std::atomic<int> tiles{ 0 }, fromCache{ 0 };
+        std::atomic<size_t> rendered{ 0 };
+        ThreadPool pool;
+        for (int j = 0; j < Height; j += TaskBlockSize) {
+            for (int i = 0; i < Width; i += TaskBlockSize) {
+                pool.addTask([&, i, j]() {
+                    int spp = renderCachedTile(cache, key, film, camera, *world, options.seed, options.spp,
+                        i, min(i + TaskBlockSize, Width), j, min(j + TaskBlockSize, Height), lights.get());
+                    tiles++;
+                    if (spp == 0) fromCache++;
+                    rendered += spp;
+                });
+            }
+        }
+        pool.start(threads);
+        pool.join();
+        cout << fromCache << " of " << tiles << " tiles from cache, " << double(rendered) / tiles
+            << " spp rendered per tile on average, cache holds " << (cache.bytes() >> 20) << " MB" << endl;
+    }
+    else {
+        // guided renders go in passes of 1, 2, 4... spp, the guide learning from
+        // each; the last pass takes whatever is left rather than a small remainder
+        PathGuide guide;
+        for (int done = 0, pass = 1; done < options.spp; pass *= 2) {
+            int left = options.spp - done;
+            int spp = options.guide && left >= 3 * pass ? pass : left;
+            ThreadPool pool;
+            for (int j = 0; j < Height; j += TaskBlockSize) {
+                for (int i = 0; i < Width; i += TaskBlockSize) {
+                    pool.addTask([&, i, j]() {
+                        accumulateTile(film, camera, *world, spp, i, min(i + TaskBlockSize, Width),
+                            j, min(j + TaskBlockSize, Height), options.guide ? &guide : nullptr, lights.get());
+                    });
+                }
+            }
+            pool.start(threads);
+            pool.join();
+            done += spp;
+            if (options.guide && done < options.spp)
+                guide.update();
+        }
+        if (options.guide)
+            cout << "Path guide has " << guide.leafCount() << " spatial cells" << endl;
+    }
+
+    Image img{ Width, Height };
+    if (options.denoise)
+        Film::writeLinear(Denoiser{ threads }.run(film), img);
+    else
+        film.toImage(img);
+    writeImage(ofstream(options.output), img);
+
+    if (options.features) {
+        string stem = options.output.substr(0, options.output.rfind('.'));
+        film.albedoToImage(img);
+        writeImage(ofstream(stem + "_albedo.ppm"), img);
+        film.normalToImage(img);
+        writeImage(ofstream(stem + "_normal.ppm"), img);
+        film.depthToImage(img);
+        writeImage(ofstream(stem + "_depth.ppm"), img);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 3 && string(argv[1]) == "--daemon") {
+        string cacheDir;
+        size_t cacheMB = RenderDaemon::DefaultCacheBytes >> 20;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            if (string(argv[i]) == "--cache") cacheDir = argv[i + 1];
+            else if (string(argv[i]) == "--cache-mb") cacheMB = stoul(argv[i + 1]);
+        }
+        RenderDaemon{ argv[2], int(std::max(1u, std::thread::hardware_concurrency())), cacheDir, cacheMB << 20 }.run();
+        return 0;
+    }
+    if (argc >= 4 && string(argv[1]) == "--request") {
+        sendRequest(argv[2], argv[3]);
+        return 0;
+    }
+
+    HeadlessOptions options;
+    bool headless = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--budget" && hasValue) options.budget = stod(argv[++i]);
+        else if (arg == "--spp" && hasValue) options.spp = stoi(argv[++i]);
+        else if (arg == "--out" && hasValue) options.output = argv[++i];
+        else if (arg == "--texture" && hasValue) options.texture = argv[++i];
+        else if (arg == "--texture-cache-mb" && hasValue) options.textureCacheMB = stoul(argv[++i]);
+        else if (arg == "--animate" && hasValue) options.animation = argv[++i];
+        else if (arg == "--fps" && hasValue) options.fps = stof(argv[++i]);
+        else if (arg == "--stream" && hasValue) {
+            string size = argv[++i];
+            auto x = size.find('x');
+            if (x == string::npos) throw invalid_argument("--stream expects WIDTHxHEIGHT");
+            options.streamWidth = stoul(size.substr(0, x));
+            options.streamHeight = stoul(size.substr(x + 1));
+        }
+        else if (arg == "--numa") options.numa = true;
+        else if (arg == "--guide") options.guide = true;
+        else if (arg == "--nee") options.nee = true;
+        else if (arg == "--scene" && hasValue) options.scene = argv[++i];
+        else if (arg == "--cache" && hasValue) options.cache = argv[++i];
+        else if (arg == "--cache-mb" && hasValue) options.cacheMB = stoul(argv[++i]);
+        else if (arg == "--seed" && hasValue) options.seed = unsigned(stoul(argv[++i]));
+        else if (arg == "--denoise") options.denoise = true;
+        else if (arg == "--features") options.features = true;
+        else continue;
+        headless = true;
+    }
+    if (headless) {
+        if (options.spp <= 0) options.spp = SampleNumber;
+        renderHeadless(options);
+        return 0;
+    }
+
     MainProgram prog;
     prog.run();
 }
-
@@ -0,0 +1,275 @@
+#pragma once
+#include <cmath>
+#include <limits>
+#include "vec3.h"
+#include "ray.h"
+#include "camera.h"
+#include "image.h"
+#include "film.h"
+#include "objects.h"
+#include "instrumentation.h"
+#include "guiding.h"
+#include "light_bvh.h"
+
+constexpr int MaxDepth = 50;
+
+// rays traced by the current thread, read by whoever wants throughput numbers
+struct RayCounter
+{
+    size_t primary = 0;
+    size_t secondary = 0;
+};
+inline thread_local RayCounter rayCounter;
+
+inline Vec3 sky(const Ray& r) {
+    float t = 0.5 * (unit_vector(r.direction()).y() + 1.0);
+    return (1.0 - t) * Vec3(1.0, 1.0, 1.0) + t * Vec3(0.5, 0.7, 1.0);
+}
+
+// the diffuse bounce a ray left from, for weighting light it hits against
+// next-event estimation at that bounce
+struct Bounce
+{
+    Vec3 normal;
+    float pdf;
+};
+
+inline float powerHeuristic(float a, float b) noexcept
+{
+    return a * a / (a * a + b * b);
+}
+
+// the lobe Lambertian::scatter samples; the weight of a bounce is then its albedo
+inline bool sampleCosine(const Vec3& n, Vec3& dir, float& weight, float& pdf) noexcept
+{
+    dir = random_cosine_direction(n);
+    float cosine = dot(dir, n);
+    if (cosine <= 0) return false;
+    pdf = cosine / float(PI);
+    weight = 1;
+    return true;
+}
+
+// The integrator, compiled once per combination of features a render can
+// leave out: lens sampling for pinhole cameras, emission lookups for scenes
+// without lights, and ray cone tracking for scenes without image textures.
+// withKernel() picks the narrowest instantiation from the camera and scene.
+template<bool DepthOfField, bool Emissive, bool Textured, int Depth = MaxDepth>
+struct Kernel
+{
+    static Ray cameraRay(const Camera& camera, float u, float v, float spread) {
+        Ray r = camera.getRay<DepthOfField>(u, v);
+        if constexpr (Textured)
+            r.spread = spread;
+        return r;
+    }
+
+    // `first`, if given, receives what a camera ray (depth 0) hit. With a
+    // `guide`, diffuse bounces are sampled from and recorded into it. With
+    // `lights`, diffuse surfaces also sample a light directly, and light a
+    // bounce happens to hit is weighted against that (multiple importance
+    // sampling, power heuristic); `from` is the bounce that made r.
+    static Vec3 color(const Ray& r, const Object& world, int depth, FirstHit* first = nullptr, PathGuide* guide = nullptr,
+        const LightBVH* lights = nullptr, const Bounce* from = nullptr) {
+        if (depth == 0) rayCounter.primary++;
+        else rayCounter.secondary++;
+        INSTRUMENT_RAY(depth);
+
+        if (auto info = world.hit(r, 0.001, std::numeric_limits<float>::max());
+            info) {
+            if constexpr (Textured)
+                info->footprint = r.cone + r.spread * info->t * r.direction().length();
+            if (first)
+                *first = FirstHit{ info->material->baseColor(*info), info->normal, info->t * r.direction().length() };
+
+            Ray scattered;
+            Vec3 attenuation;
+            Vec3 emitted;
+            if constexpr (Emissive) {
+                emitted = info->material->emitted(info->u, info->v, info->p);
+                if (lights && from && info->object) {
+                    float lightPdf = lights->pmf(r.origin(), from->normal, info->object)
+                        * info->object->lightPdf(r.origin(), r.direction());
+                    emitted *= powerHeuristic(from->pdf, lightPdf);
+                }
+            }
+
+            if ((guide || lights) && depth < Depth && info->material->diffuse()) {
+                Vec3 n = dot(r.direction(), info->normal) > 0 ? -info->normal : info->normal;
+                Vec3 albedo = info->material->baseColor(*info);
+                Vec3 direct(0, 0, 0);
+                if constexpr (Emissive) {
+                    if (lights)
+                        direct = albedo * directLight(world, *lights, info->p, n, guide);
+                }
+                Vec3 dir;
+                float weight, pdf;
+                if (guide ? guide->sampleDiffuse(info->p, n, dir, weight, pdf) : sampleCosine(n, dir, weight, pdf)) {
+                    scattered = Ray(info->p, dir);
+                    scattered.spread = Lambertian::DiffuseSpread;
+                    if constexpr (Textured) {
+                        scattered.cone = info->footprint;
+                        scattered.spread = std::max(scattered.spread, r.spread);
+                    }
+                    Bounce bounce{ n, pdf };
+                    Vec3 incoming = color(scattered, world, depth + 1, nullptr, guide, lights, &bounce);
+                    if (guide)
+                        guide->record(info->p, dir, incoming, pdf);
+                    return emitted + direct + weight * albedo * incoming;
+                }
+                INSTRUMENT_PATH_END(depth);
+                return emitted + direct;
+            }
+            if (depth < Depth && info->material->scatter(r, *info, attenuation, scattered)) {
+                if constexpr (Textured) {
+                    scattered.cone = info->footprint;
+                    scattered.spread = std::max(scattered.spread, r.spread);
+                }
+                return emitted + attenuation * color(scattered, world, depth + 1, nullptr, guide, lights);
+            }
+            INSTRUMENT_PATH_END(depth);
+            return emitted;
+
+        }
+        INSTRUMENT_PATH_END(depth);
+        if (first)
+            *first = FirstHit{ sky(r), Vec3(0, 0, 0), FarDepth };
+        return sky(r);
+    }
+
+    // one light picked from the BVH for a diffuse surface at p facing n, as
+    // radiance * cosine / pi, to be multiplied by the albedo
+    static Vec3 directLight(const Object& world, const LightBVH& lights, const Vec3& p, const Vec3& n, const PathGuide* guide) {
+        float pmf;
+        const Object* light = lights.pick(p, n, pmf);
+        LightSample sample;
+        if (!light || !light->sampleLight(p, sample)) return Vec3(0, 0, 0);
+        Vec3 d = sample.p - p;
+        float dist = d.length();
+        float cosine = dot(d, n) / dist;
+        if (cosine <= 0) return Vec3(0, 0, 0);
+        rayCounter.secondary++;
+        if (world.hit(Ray(p, d), 0.001f, 1 - 1e-3f)) return Vec3(0, 0, 0);
+        float lightPdf = pmf * sample.pdf;
+        float bsdfPdf = guide ? guide->pdfDiffuse(p, n, d / dist) : cosine / float(PI);
+        return sample.radiance * (cosine / float(PI) / lightPdf * powerHeuristic(lightPdf, bsdfPdf));
+    }
+};
+
+using FullKernel = Kernel<true, true, true>;
+
+// calls f with a default-constructed Kernel matching the camera and scene
+template<bool DepthOfField, bool Emissive, class F>
+void withTexturedKernel(const SceneFeatures& features, F&& f) {
+    if (features.imageTextures) f(Kernel<DepthOfField, Emissive, true>{});
+    else f(Kernel<DepthOfField, Emissive, false>{});
+}
+
+template<bool DepthOfField, class F>
+void withEmissiveKernel(const SceneFeatures& features, F&& f) {
+    if (features.emissive) withTexturedKernel<DepthOfField, true>(features, f);
+    else withTexturedKernel<DepthOfField, false>(features, f);
+}
+
+template<class F>
+void withKernel(const Camera& camera, const Object& world, F&& f) {
+    SceneFeatures features = world.features();
+    if (camera.aperture > 0) withEmissiveKernel<true>(features, f);
+    else withEmissiveKernel<false>(features, f);
+}
+
+inline Vec3 color(const Ray& r, const Object& world, int depth, FirstHit* first = nullptr) {
+    return FullKernel::color(r, world, depth, first);
+}
+
+// angle covered by one pixel, the spread of camera ray cones
+inline float pixelSpread(const Camera& camera, size_t height) {
+    return float(camera.vfov * PI / 180) / float(height);
+}
+
+inline Ray cameraRay(const Camera& camera, float u, float v, float spread) {
+    return FullKernel::cameraRay(camera, u, v, spread);
+}
+
+// traces the pixels i_low <= i < i_high, j_low <= j < j_high of a width x height
+// image and hands each gamma-corrected colour to store(i, j, col). Colours are
+// not clamped, emitters and what they light go above 1. With lights, they are
+// sampled directly (next-event estimation).
+template<class Store>
+void renderPixels(const Camera& camera, const Object& world, int samples, size_t width, size_t height,
+    int i_low, int i_high, int j_low, int j_high, const LightBVH* lights, Store&& store)
+{
+    INSTRUMENT_TILE(i_low, i_high, j_low, j_high);
+    float spread = pixelSpread(camera, height);
+    withKernel(camera, world, [&](auto kernel) {
+        using K = decltype(kernel);
+        for (int i = i_low; i < i_high; i++)
+        {
+            for (int j = j_low; j < j_high; j++)
+            {
+                INSTRUMENT_PIXEL(i, j);
+                Vec3 col = { 0,0,0 };
+
+                for (int s = 0; s < samples; s++) {
+                    float u = float(i + random_double()) / float(width);
+                    float v = float(j + random_double()) / float(height);
+                    col += K::color(K::cameraRay(camera, u, v, spread), world, 0, nullptr, nullptr, lights);
+                }
+                col /= samples;
+                col = Vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
+
+                store(i, j, col);
+            }
+        }
+    });
+}
+
+inline void renderTile(Image& img, const Camera& camera, const Object& world, int samples,
+    int i_low, int i_high, int j_low, int j_high, const LightBVH* lights = nullptr)
+{
+    renderPixels(camera, world, samples, img.width, img.height, i_low, i_high, j_low, j_high, lights,
+        [&](int i, int j, const Vec3& col) { img.getPixel(i, j).setPixel(Film::clamp01(col) * 255.99); });
+}
+
+// the loop behind accumulateTile(); beginSample(i, j, s) runs before each sample
+template<class BeginSample>
+void accumulateSamples(Film& film, const Camera& camera, const Object& world, int firstSample, int samples,
+    int i_low, int i_high, int j_low, int j_high, PathGuide* guide, const LightBVH* lights, BeginSample&& beginSample)
+{
+    INSTRUMENT_TILE(i_low, i_high, j_low, j_high);
+    float spread = pixelSpread(camera, film.height);
+    withKernel(camera, world, [&](auto kernel) {
+        using K = decltype(kernel);
+        for (int s = firstSample; s < firstSample + samples; s++) {
+            for (int j = j_low; j < j_high; j++) {
+                for (int i = i_low; i < i_high; i++) {
+                    INSTRUMENT_PIXEL(i, j);
+                    beginSample(i, j, s);
+                    float u = float(i + random_double()) / float(film.width);
+                    float v = float(j + random_double()) / float(film.height);
+                    FirstHit first;
+                    film.addSample(i, j, K::color(K::cameraRay(camera, u, v, spread), world, 0, &first, guide, lights));
+                    film.addFeatures(i, j, first);
+                }
+            }
+        }
+    });
+}
+
+// adds `samples` more samples (and their first-hit features) to every pixel of the tile
+inline void accumulateTile(Film& film, const Camera& camera, const Object& world, int samples,
+    int i_low, int i_high, int j_low, int j_high, PathGuide* guide = nullptr, const LightBVH* lights = nullptr)
+{
+    accumulateSamples(film, camera, world, 0, samples, i_low, i_high, j_low, j_high, guide, lights,
+        [](int, int, int) {});
+}
+
+// adds samples [firstSample, firstSample + samples) of a render seeded with
+// `seed`; each sample reseeds the generator (seed_sample), so a sample range
+// comes out the same in any tile, thread or pass
+inline void accumulateTileSeeded(Film& film, const Camera& camera, const Object& world, unsigned seed,
+    int firstSample, int samples, int i_low, int i_high, int j_low, int j_high, const LightBVH* lights = nullptr)
+{
+    accumulateSamples(film, camera, world, firstSample, samples, i_low, i_high, j_low, j_high, nullptr, lights,
+        [seed](int i, int j, int s) { seed_sample(seed, unsigned(i), unsigned(j), unsigned(s)); });
+}
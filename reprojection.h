@@ -0,0 +1,78 @@
+#pragma once
+#include <limits>
+#include <vector>
+#include "vec3.h"
+#include "camera.h"
+#include "film.h"
+
+// Carries the film's picture over to a moved camera. Each pixel's first-hit
+// point is rebuilt from the depth buffer, projected into the new view and
+// splatted there, nearest point winning. What lands becomes the film's
+// history, which is shown straight away and fades out as fresh samples
+// arrive. Single-pixel cracks from the forward warp are filled from their
+// neighbours; everything else nothing landed on is disoccluded and returned
+// as true in the mask so it can be traced first.
+inline std::vector<bool> reproject(Film& film, const Camera& from, const Camera& to)
+{
+    size_t width = film.width, height = film.height;
+    std::vector<Vec3> color = film.resolve();
+    std::vector<float> depth(width * height);
+    std::vector<bool> covered(width * height);
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            depth[y * width + x] = film.depth(x, y);
+            covered[y * width + x] = film.covered(x, y);
+        }
+    }
+    film.clear();
+
+    std::vector<float> nearest(width * height, std::numeric_limits<float>::max());
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            size_t idx = y * width + x;
+            if (!covered[idx]) continue;
+            Vec3 dir = unit_vector(from.direction((x + 0.5f) / width, (y + 0.5f) / height));
+            Vec3 p = from.lookfrom + depth[idx] * dir;
+            float s, t;
+            if (!to.project(p, s, t) || s < 0 || s >= 1 || t < 0 || t >= 1) continue;
+            size_t target = size_t(t * height) * width + size_t(s * width);
+            float z = (p - to.lookfrom).length();
+            if (z < nearest[target]) {
+                nearest[target] = z;
+                film.history[target] = color[idx];
+                film.historyDepth[target] = z;
+                film.historyWeight[target] = 1;
+            }
+        }
+    }
+
+    std::vector<bool> holes(width * height);
+    for (size_t y = 0; y < height; y++) {
+        for (size_t x = 0; x < width; x++) {
+            size_t idx = y * width + x;
+            if (nearest[idx] < std::numeric_limits<float>::max()) continue;
+            Vec3 sum(0, 0, 0);
+            float depthSum = 0;
+            int n = 0;
+            auto take = [&](size_t q) {
+                if (nearest[q] == std::numeric_limits<float>::max()) return;
+                sum += film.history[q];
+                depthSum += film.historyDepth[q];
+                n++;
+            };
+            if (x > 0) take(idx - 1);
+            if (x + 1 < width) take(idx + 1);
+            if (y > 0) take(idx - width);
+            if (y + 1 < height) take(idx + width);
+            if (n >= 2) {
+                film.history[idx] = sum / float(n);
+                film.historyDepth[idx] = depthSum / n;
+                film.historyWeight[idx] = 0.5f;
+            }
+            else {
+                holes[idx] = true;
+            }
+        }
+    }
+    return holes;
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include "vec3.h"
+#include "random.h"
+#include "camera.h"
+#include "materials.h"
+#include "objects.h"
+
+// Scene generators shared by the viewer and the benchmark. They return the flat
+// object list so callers can decide when (and how) to build the BVH.
+
+inline std::shared_ptr<Material> randomMaterial(float choose_mat) {
+    if (choose_mat < 0.8) {  // diffuse
+        return std::make_shared<Lambertian>(std::make_shared<ConstantTexture>(
+            Vec3(random_double() * random_double(),
+                random_double() * random_double(),
+                random_double() * random_double())));
+    }
+    if (choose_mat < 0.95) { // metal
+        return std::make_shared<Metal>(Vec3(0.5 * (1 + random_double()),
+            0.5 * (1 + random_double()),
+            0.5 * (1 + random_double())),
+            0.5 * random_double());
+    }
+    return std::make_shared<Dielectric>(1.5); // glass
+}
+
+inline std::shared_ptr<Material> checkerGround() {
+    return std::make_shared<Lambertian>(
+        std::make_shared<CheckerTexture>(
+            std::make_shared<ConstantTexture>(Vec3{ 0.2, 0.3, 0.1 }),
+            std::make_shared<ConstantTexture>(Vec3{ 0.9, 0.9, 0.9 })
+        )
+    );
+}
+
+inline ObjectGroup generateRandomScene() {
+    ObjectGroup list;
+    list.addObject<Sphere>(Vec3(0, -1000, 0), 1000, checkerGround());
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            float choose_mat = random_double();
+            Vec3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+            if ((center - Vec3(4, 0.2, 0)).length() > 0.9) {
+                list.addObject<Sphere>(center, 0.2, randomMaterial(choose_mat));
+            }
+        }
+    }
+
+    list.addObject<Sphere>(Vec3{ 0, 1, 0 }, 1.0, std::make_shared<Dielectric>(1.5));
+    list.addObject<Sphere>(Vec3{ -4, 1, 0 }, 1.0, std::make_shared<Lambertian>(std::make_shared<ConstantTexture>(Vec3{ 0.4, 0.2, 0.1 })));
+    list.addObject<Sphere>(Vec3{ 4, 1, 0 }, 1.0, std::make_shared<Metal>(Vec3{ 0.7, 0.6, 0.5 }, 0.0));
+
+    list.addObject<XYRect>(0, 2, 0, 1, 2,
+        std::make_shared<DiffuseLight>(std::make_shared<ConstantTexture>(Vec3(0, 1, 1))));
+
+    return list;
+}
+
+// n * n small spheres packed on the ground plane
+inline ObjectGroup generateDenseScene(int n = 100) {
+    ObjectGroup list;
+    list.addObject<Sphere>(Vec3(0, -1000, 0), 1000, checkerGround());
+    float spacing = 20.0f / n;
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            Vec3 center(-10 + spacing * (a + 0.5f), spacing * 0.4f, -10 + spacing * (b + 0.5f));
+            list.addObject<Sphere>(center, spacing * 0.4f, randomMaterial(random_double()));
+        }
+    }
+    return list;
+}
+
+// a uv sphere tessellated into 2 * stacks * slices triangles
+inline void addMeshSphere(ObjectGroup& list, Vec3 center, float radius, int stacks, int slices,
+    std::shared_ptr<Material> material) {
+    auto vertex = [&](int stack, int slice) {
+        float theta = float(PI) * stack / stacks;
+        float phi = 2 * float(PI) * slice / slices;
+        return center + radius * Vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+    };
+    for (int i = 0; i < stacks; i++) {
+        for (int j = 0; j < slices; j++) {
+            Vec3 a = vertex(i, j), b = vertex(i + 1, j), c = vertex(i + 1, j + 1), d = vertex(i, j + 1);
+            if (i != 0) list.addObject<Triangle>(a, d, c, material);
+            if (i != stacks - 1) list.addObject<Triangle>(a, c, b, material);
+        }
+    }
+}
+
+inline ObjectGroup generateMeshScene() {
+    ObjectGroup list;
+    list.addObject<Sphere>(Vec3(0, -1000, 0), 1000, checkerGround());
+    for (int a = -3; a <= 3; a++) {
+        for (int b = -3; b <= 3; b++) {
+            addMeshSphere(list, Vec3(a * 1.5f, 0.6f, b * 1.5f), 0.6f, 24, 48, randomMaterial(random_double()));
+        }
+    }
+    return list;
+}
+
+// a dim scene lit mostly by a grid of small area lights
+inline ObjectGroup generateLightScene() {
+    ObjectGroup list;
+    list.addObject<Sphere>(Vec3(0, -1000, 0), 1000, checkerGround());
+    for (int a = -4; a <= 4; a++) {
+        for (int b = -4; b <= 4; b++) {
+            list.addObject<Sphere>(Vec3(a + 0.5 * random_double(), 0.3, b + 0.5 * random_double()), 0.3, randomMaterial(random_double()));
+        }
+    }
+    for (int a = -5; a < 5; a++) {
+        for (int b = 0; b < 3; b++) {
+            auto light = std::make_shared<DiffuseLight>(std::make_shared<ConstantTexture>(
+                Vec3(2 + 2 * random_double(), 2 + 2 * random_double(), 2 + 2 * random_double())));
+            list.addObject<XYRect>(a, a + 0.6f, 1.0f + b, 1.3f + b, -5, light);
+        }
+    }
+    return list;
+}
+
+// thousands of tiny lights scattered between the spheres, for light sampling
+inline ObjectGroup generateManyLightsScene(int n = 4000) {
+    ObjectGroup list;
+    list.addObject<Sphere>(Vec3(0, -1000, 0), 1000, checkerGround());
+    for (int a = -5; a <= 5; a++) {
+        for (int b = -5; b <= 5; b++) {
+            list.addObject<Sphere>(Vec3(2 * a + random_double(), 0.5, 2 * b + random_double()), 0.5, randomMaterial(random_double()));
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        auto light = std::make_shared<DiffuseLight>(std::make_shared<ConstantTexture>(
+            Vec3(5 + 20 * random_double(), 5 + 20 * random_double(), 5 + 20 * random_double())));
+        list.addObject<Sphere>(Vec3(24 * random_double() - 12, 1.2 + 2 * random_double(), 24 * random_double() - 12), 0.03, light);
+    }
+    return list;
+}
+
+// the scenes that can be picked by name, by the headless renderer and the daemon
+inline const std::map<std::string, std::function<ObjectGroup()>>& namedScenes() {
+    static const std::map<std::string, std::function<ObjectGroup()>> scenes = {
+        { "random", [] { return generateRandomScene(); } },
+        { "dense", [] { return generateDenseScene(); } },
+        { "mesh", [] { return generateMeshScene(); } },
+        { "lights", [] { return generateLightScene(); } },
+        { "manylights", [] { return generateManyLightsScene(); } },
+    };
+    return scenes;
+}
+
+// the random scene's large spheres and a back panel wearing an image texture
+inline ObjectGroup generateTexturedScene(std::shared_ptr<Texture> image) {
+    ObjectGroup list;
+    list.addObject<Sphere>(Vec3(0, -1000, 0), 1000, checkerGround());
+    auto textured = std::make_shared<Lambertian>(image);
+    list.addObject<Sphere>(Vec3{ 0, 1, 0 }, 1.0, textured);
+    list.addObject<Sphere>(Vec3{ -4, 1, 0 }, 1.0, textured);
+    list.addObject<Sphere>(Vec3{ 4, 1, 0 }, 1.0, std::make_shared<Metal>(Vec3{ 0.7, 0.6, 0.5 }, 0.0));
+    list.addObject<XYRect>(-6, 6, 0, 4, -3, textured);
+    return list;
+}
@@ -48,5 +48,16 @@ inline GLuint createProgram(Shader& vert, Shader& frag)
     glAttachShader(ProgramID, vert.native());
     glAttachShader(ProgramID, frag.native());
     glLinkProgram(ProgramID);
+    int status{};
+    glGetProgramiv(ProgramID, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        int logLen = 0;
+        glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &logLen);
+        std::string log(static_cast<size_t>(logLen + 1), '\0');
+        glGetProgramInfoLog(ProgramID, logLen + 1, &logLen, log.data());
+        std::cerr << "Could not link program: " << log;
+        glDeleteProgram(ProgramID);
+        throw std::runtime_error(log);
+    }
     return ProgramID;
 }
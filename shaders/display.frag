@@ -0,0 +1,16 @@
+#version 330 core
+in vec2 uv;
+out vec4 fragColor;
+
+uniform sampler2D film;
+uniform float exposure;
+uniform bool reinhard;
+
+void main()
+{
+    vec3 c = texture(film, uv).rgb * exposure;
+    if (reinhard)
+        c = c / (1.0 + c);
+    // gamma 2, same as the saved image
+    fragColor = vec4(sqrt(clamp(c, 0.0, 1.0)), 1.0);
+}
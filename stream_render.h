@@ -0,0 +1,129 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "camera.h"
+#include "mapped_file.h"
+#include "objects.h"
+#include "renderer.h"
+#include "threadpool.h"
+
+// Renders straight into a binary PPM on disk, for images too big to hold in
+// memory. The file is mapped writable and tiles are traced in file order
+// (top band first, left to right) with at most `lookahead` tiles past the
+// first unfinished one. Whatever lies before that tile is complete, so it is
+// written back and dropped from memory as the frontier moves. Resident
+// memory depends on tile size and lookahead, not on the image size.
+class StreamRenderer
+{
+public:
+    StreamRenderer(const Object& world, const Camera& camera, const std::string& path,
+        size_t width, size_t height, int threads, const LightBVH* lights = nullptr, int tileSize = 64, int lookahead = 0)
+        : world(world), camera(camera), lights(lights), width(width), height(height), threads(std::max(1, threads)),
+        tileSize(tileSize), lookahead(lookahead > 0 ? lookahead : 4 * this->threads),
+        header("P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n"),
+        file(path, header.size() + width * height * 3), page(MappedFile::pageSize())
+    {
+        std::copy(header.begin(), header.end(), file.writableData());
+    }
+
+    void render(int samples)
+    {
+        size_t tilesX = (width + tileSize - 1) / tileSize;
+        size_t tilesY = (height + tileSize - 1) / tileSize;
+        size_t total = tilesX * tilesY;
+        // ring of done flags, tile n uses slot n % lookahead
+        std::vector<char> done(lookahead, 0);
+
+        ThreadPool pool;
+        pool.start(threads, true);
+        size_t next = 0, frontier = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (frontier < total) {
+            for (; next < total && next < frontier + lookahead; next++) {
+                pool.addTask([this, &done, samples, tilesX, n = next]() {
+                    renderTile(samples, n / tilesX, n % tilesX);
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        done[n % lookahead] = 1;
+                    }
+                    tileDone.notify_one();
+                });
+            }
+            tileDone.wait(lock, [&]() { return done[frontier % lookahead] != 0; });
+            while (frontier < next && done[frontier % lookahead]) {
+                done[frontier % lookahead] = 0;
+                frontier++;
+            }
+            lock.unlock();
+            releaseBefore(frontier, tilesX);
+            lock.lock();
+        }
+        lock.unlock();
+        pool.close();
+        file.release(0, file.size());
+    }
+
+private:
+    // band 0 holds the top rows, which come first in the file
+    void renderTile(int samples, size_t band, size_t column)
+    {
+        size_t rowLow = band * tileSize, rowHigh = std::min(rowLow + tileSize, height);
+        int i_low = int(column * tileSize), i_high = int(std::min(column * tileSize + tileSize, width));
+        unsigned char* pixels = file.writableData() + header.size();
+        renderPixels(camera, world, samples, width, height, i_low, i_high,
+            int(height - rowHigh), int(height - rowLow), lights, [&](int i, int j, const Vec3& col) {
+                unsigned char* p = pixels + ((height - 1 - j) * width + i) * 3;
+                for (int c = 0; c < 3; c++)
+                    p[c] = static_cast<unsigned char>(std::min(col[c] * 255.99f, 255.0f));
+            });
+    }
+
+    size_t rowOffset(size_t row) const noexcept { return header.size() + row * width * 3; }
+
+    // every tile before `frontier` is finished
+    void releaseBefore(size_t frontier, size_t tilesX)
+    {
+        size_t band = frontier / tilesX, column = frontier % tilesX;
+        size_t rowLow = band * tileSize, rowHigh = std::min(rowLow + tileSize, height);
+        // whole bands
+        releaseRange(released, rowOffset(rowLow));
+        // and the finished start of each row in the current band
+        if (band != releasedBand) {
+            releasedBand = band;
+            releasedColumns = 0;
+        }
+        size_t x0 = releasedColumns * tileSize * 3, x1 = std::min(column * tileSize, width) * 3;
+        if (x1 > x0) {
+            for (size_t row = rowLow; row < rowHigh; row++)
+                releaseRange(rowOffset(row) + x0, rowOffset(row) + x1);
+            releasedColumns = column;
+        }
+    }
+
+    // releases the pages entirely inside [begin, end)
+    void releaseRange(size_t begin, size_t end)
+    {
+        begin = (begin + page - 1) / page * page;
+        end = std::min(end, file.size()) / page * page;
+        if (end <= begin) return;
+        file.release(begin, end - begin);
+        if (begin <= released) released = std::max(released, end);
+    }
+
+    const Object& world;
+    const Camera& camera;
+    const LightBVH* lights;
+    size_t width, height;
+    int threads, tileSize, lookahead;
+    std::string header;
+    MappedFile file;
+    size_t page;
+
+    std::mutex mutex;
+    std::condition_variable tileDone;
+    size_t released = 0; // everything before this offset is written back
+    size_t releasedBand = 0, releasedColumns = 0;
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include <cmath>
+#include <memory>
+#include <string>
+#include <typeinfo>
+#include "hash.h"
+#include "vec3.h"
+
+class Texture {
+public:
+    virtual ~Texture() {}
+    virtual Vec3 value(float u, float v, const Vec3& p) const = 0;
+    // the type and every parameter that changes what value() gives, for cache keys
+    virtual void hash(Hasher& h) const { h.add(std::string(typeid(*this).name())); }
+};
+
+class ConstantTexture : public Texture {
+public:
+    ConstantTexture(Vec3 color) : color(color) {}
+    Vec3 value(float u, float v, const Vec3& p) const override {
+        return color;
+    }
+    void hash(Hasher& h) const override {
+        Texture::hash(h);
+        h.add(color);
+    }
+
+    Vec3 color;
+};
+
+// 3D checkerboard, switching between two textures every pi / frequency units
+class CheckerTexture : public Texture {
+public:
+    CheckerTexture(std::shared_ptr<Texture> even, std::shared_ptr<Texture> odd, float frequency = 10)
+        : even(std::move(even)), odd(std::move(odd)), frequency(frequency) {}
+    Vec3 value(float u, float v, const Vec3& p) const override {
+        float sines = std::sin(frequency * p.x()) * std::sin(frequency * p.y()) * std::sin(frequency * p.z());
+        return sines < 0 ? odd->value(u, v, p) : even->value(u, v, p);
+    }
+    void hash(Hasher& h) const override {
+        Texture::hash(h);
+        h.add(frequency);
+        even->hash(h);
+        odd->hash(h);
+    }
+
+    std::shared_ptr<Texture> even, odd;
+    float frequency;
+};
@@ -0,0 +1,406 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "vec3.h"
+#include "hash.h"
+#include "texture.h"
+#include "mapped_file.h"
+
+// Image textures backed by a pre-tiled mip pyramid on disk.
+//
+// buildTextureCache() converts a PPM once into a cache file: a header, a level
+// table and then every mip level cut into TextureTileSize^2 RGB8 tiles stored
+// contiguously, so one tile is one small contiguous read. The conversion
+// streams, so the image never has to fit in memory. Rendering maps the file
+// and decodes tiles on demand into the process-wide TextureCache (LRU,
+// bounded in bytes). In front of that every thread keeps a few recently used
+// tiles, so most texel fetches never take a lock.
+
+constexpr int TextureTileSize = 64;
+constexpr uint32_t TextureCacheVersion = 1;
+
+struct TextureFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t tileSize;
+    uint32_t levels;
+};
+
+struct TextureLevel
+{
+    uint32_t width, height;
+    uint32_t tilesX, tilesY;
+    uint64_t offset;
+};
+
+// Reads a P3 or P6 PPM with maxval 255 one row at a time, top row first.
+class PPMReader
+{
+public:
+    explicit PPMReader(const std::string& path) : path(path), file(path, std::ios::binary)
+    {
+        int maxval;
+        file >> magic >> width >> height >> maxval;
+        if (!file || (magic != "P3" && magic != "P6") || maxval != 255 || width == 0 || height == 0)
+            throw std::runtime_error("unsupported image " + path);
+        file.get();
+    }
+
+    // the next row as linear RGB floats (the renderer writes gamma 2)
+    void readRow(std::vector<float>& rgb)
+    {
+        rgb.resize(size_t(width) * 3);
+        if (magic == "P6") {
+            bytes.resize(rgb.size());
+            file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+            for (size_t i = 0; i < rgb.size(); i++)
+                rgb[i] = bytes[i] / 255.0f;
+        }
+        else {
+            for (size_t i = 0; i < rgb.size(); i++) {
+                int v;
+                file >> v;
+                rgb[i] = v / 255.0f;
+            }
+        }
+        if (!file)
+            throw std::runtime_error("truncated image " + path);
+        for (auto& c : rgb) c *= c;
+    }
+
+    uint32_t width = 0, height = 0;
+
+private:
+    std::string path, magic;
+    std::ifstream file;
+    std::vector<unsigned char> bytes;
+};
+
+// One mip level being converted. Rows come in from the top (texture rows go
+// bottom up, v = 0 at the bottom, and PPMs are stored top down), are gathered
+// into a band one tile high and written out as tiles once the band's bottom
+// row is in. Pairs of rows are averaged into the next level as they arrive.
+struct TextureLevelWriter
+{
+    TextureLevel info;
+    std::vector<unsigned char> band; // TextureTileSize rows of tilesX * TextureTileSize RGB8 texels
+    std::vector<float> pending;      // odd row waiting for the even one below it
+    std::vector<float> next;
+
+    explicit TextureLevelWriter(const TextureLevel& info)
+        : info(info), band(size_t(info.tilesX) * TextureTileSize * TextureTileSize * 3)
+    {
+    }
+
+    // row y of this level as linear RGB; returns true with the next level's row in `next`
+    bool addRow(uint32_t y, const std::vector<float>& rgb, std::ofstream& out)
+    {
+        size_t stride = size_t(info.tilesX) * TextureTileSize * 3;
+        // the top band repeats the last row, as edge tiles do the last column
+        uint32_t top = y + 1 == info.height ? (y / TextureTileSize + 1) * TextureTileSize : y + 1;
+        for (uint32_t by = y; by < top; by++) {
+            unsigned char* row = band.data() + (by % TextureTileSize) * stride;
+            for (uint32_t x = 0; x < info.tilesX * TextureTileSize; x++) {
+                uint32_t sx = std::min(x, info.width - 1);
+                for (int c = 0; c < 3; c++)
+                    row[x * 3 + c] = static_cast<unsigned char>(std::sqrt(std::min(rgb[sx * 3 + c], 1.0f)) * 255.0f + 0.5f);
+            }
+        }
+        if (y % TextureTileSize == 0)
+            writeBand(y / TextureTileSize, out);
+
+        // 2x2 box filter, odd edges clamp; rows past the last full pair are dropped
+        uint32_t nw = std::max(1u, info.width / 2), nh = std::max(1u, info.height / 2);
+        if (info.height > 1 && y >= 2 * nh) return false;
+        if (info.height > 1 && y % 2 == 1) {
+            pending = rgb;
+            return false;
+        }
+        const std::vector<float>& above = info.height > 1 ? pending : rgb;
+        next.resize(size_t(nw) * 3);
+        for (uint32_t x = 0; x < nw; x++) {
+            uint32_t x0 = std::min(2 * x, info.width - 1), x1 = std::min(2 * x + 1, info.width - 1);
+            for (int c = 0; c < 3; c++)
+                next[x * 3 + c] = 0.25f * (rgb[x0 * 3 + c] + rgb[x1 * 3 + c] + above[x0 * 3 + c] + above[x1 * 3 + c]);
+        }
+        return true;
+    }
+
+    void writeBand(uint32_t ty, std::ofstream& out)
+    {
+        size_t stride = size_t(info.tilesX) * TextureTileSize * 3;
+        std::vector<unsigned char> tile(TextureTileSize * TextureTileSize * 3);
+        out.seekp(std::streamoff(info.offset + uint64_t(ty) * info.tilesX * tile.size()));
+        for (uint32_t tx = 0; tx < info.tilesX; tx++) {
+            for (int y = 0; y < TextureTileSize; y++)
+                std::memcpy(tile.data() + y * TextureTileSize * 3,
+                    band.data() + y * stride + size_t(tx) * TextureTileSize * 3, TextureTileSize * 3);
+            out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+        }
+    }
+};
+
+// Streams the PPM through: each level only keeps one band of tiles and a
+// row, so images much larger than RAM convert too.
+inline void buildTextureCache(const std::string& ppmPath, const std::string& cachePath)
+{
+    PPMReader ppm(ppmPath);
+    uint32_t width = ppm.width, height = ppm.height;
+
+    std::vector<TextureLevelWriter> levels;
+    uint32_t levelCount = 1 + uint32_t(std::floor(std::log2(std::max(width, height))));
+    uint64_t offset = sizeof(TextureFileHeader) + sizeof(TextureLevel) * levelCount;
+    for (uint32_t l = 0, w = width, h = height; l < levelCount; l++) {
+        TextureLevel info{ w, h, (w + TextureTileSize - 1) / TextureTileSize, (h + TextureTileSize - 1) / TextureTileSize, offset };
+        levels.emplace_back(info);
+        offset += uint64_t(info.tilesX) * info.tilesY * TextureTileSize * TextureTileSize * 3;
+        w = std::max(1u, w / 2);
+        h = std::max(1u, h / 2);
+    }
+
+    std::ofstream out(cachePath, std::ios::binary);
+    TextureFileHeader header{ { 'R', 'T', 'T', 'X' }, TextureCacheVersion, width, height, TextureTileSize, levelCount };
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (auto& level : levels)
+        out.write(reinterpret_cast<const char*>(&level.info), sizeof(TextureLevel));
+
+    std::vector<float> row;
+    for (uint32_t y = height; y-- > 0;) {
+        ppm.readRow(row);
+        // hand the row down the pyramid as far as it completes rows
+        const std::vector<float>* rgb = &row;
+        for (uint32_t l = 0, ly = y; l < levelCount; l++, ly /= 2) {
+            if (!levels[l].addRow(ly, *rgb, out)) break;
+            rgb = &levels[l].next;
+        }
+    }
+    if (!out)
+        throw std::runtime_error("cannot write " + cachePath);
+}
+
+class TextureFile
+{
+public:
+    explicit TextureFile(const std::string& path) : file(path)
+    {
+        if (file.size() < sizeof(TextureFileHeader))
+            throw std::runtime_error("bad texture cache " + path);
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (std::memcmp(header.magic, "RTTX", 4) != 0 || header.version != TextureCacheVersion
+            || header.tileSize != TextureTileSize || header.levels == 0)
+            throw std::runtime_error("bad texture cache " + path);
+        table.resize(header.levels);
+        std::memcpy(table.data(), file.data() + sizeof(header), sizeof(TextureLevel) * header.levels);
+        auto& last = table.back();
+        if (last.offset + uint64_t(last.tilesX) * last.tilesY * TextureTileSize * TextureTileSize * 3 > file.size())
+            throw std::runtime_error("truncated texture cache " + path);
+        static std::atomic<uint32_t> nextId{ 0 };
+        id = nextId++;
+    }
+
+    int levels() const noexcept { return int(header.levels); }
+    const TextureLevel& level(int l) const noexcept { return table[l]; }
+
+    const unsigned char* tileData(int l, uint32_t tx, uint32_t ty) const noexcept
+    {
+        auto& info = table[l];
+        return file.data() + info.offset + (uint64_t(ty) * info.tilesX + tx) * TextureTileSize * TextureTileSize * 3;
+    }
+
+    // the whole converted file, so every texel counts
+    void hash(Hasher& h) const noexcept { h.add(file.data(), file.size()); }
+
+    uint32_t id;
+
+private:
+    MappedFile file;
+    TextureFileHeader header;
+    std::vector<TextureLevel> table;
+};
+
+struct TextureTile
+{
+    std::array<Vec3, TextureTileSize * TextureTileSize> texels;
+};
+
+// Process-wide decoded tile cache. Split into shards by key so threads missing
+// on different tiles rarely wait for each other.
+class TextureCache
+{
+public:
+    static TextureCache& instance()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    void setCapacity(size_t bytes)
+    {
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.capacity = std::max<size_t>(1, bytes / sizeof(TextureTile) / ShardCount);
+            shard.evict();
+        }
+    }
+
+    static uint64_t key(uint32_t fileId, int level, uint32_t tx, uint32_t ty) noexcept
+    {
+        return (uint64_t(fileId) << 48) | (uint64_t(level) << 40) | (uint64_t(ty) << 20) | tx;
+    }
+
+    std::shared_ptr<const TextureTile> get(const TextureFile& file, int level, uint32_t tx, uint32_t ty)
+    {
+        uint64_t k = key(file.id, level, tx, ty);
+        auto& shard = shards[(k ^ (k >> 20) ^ (k >> 40)) % ShardCount];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (auto it = shard.map.find(k); it != shard.map.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second.second);
+                return it->second.first;
+            }
+        }
+
+        // decode outside the lock; a racing thread may decode the same tile, which is harmless
+        misses++;
+        auto tile = std::make_shared<TextureTile>();
+        const unsigned char* src = file.tileData(level, tx, ty);
+        for (size_t i = 0; i < tile->texels.size(); i++) {
+            Vec3 col(src[i * 3] / 255.0f, src[i * 3 + 1] / 255.0f, src[i * 3 + 2] / 255.0f);
+            tile->texels[i] = col * col;
+        }
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (auto it = shard.map.find(k); it != shard.map.end())
+            return it->second.first;
+        shard.lru.push_front(k);
+        shard.map.emplace(k, std::make_pair(tile, shard.lru.begin()));
+        shard.evict();
+        return tile;
+    }
+
+    std::atomic<size_t> misses{ 0 };
+
+private:
+    static constexpr size_t ShardCount = 16;
+    static constexpr size_t DefaultCapacity = size_t(256) << 20;
+
+    struct Shard
+    {
+        void evict()
+        {
+            while (map.size() > capacity) {
+                map.erase(lru.back());
+                lru.pop_back();
+            }
+        }
+
+        std::mutex mutex;
+        std::list<uint64_t> lru;
+        std::unordered_map<uint64_t, std::pair<std::shared_ptr<const TextureTile>, std::list<uint64_t>::iterator>> map;
+        size_t capacity = DefaultCapacity / sizeof(TextureTile) / ShardCount;
+    };
+
+    TextureCache() = default;
+    Shard shards[ShardCount];
+};
+
+class ImageTexture : public Texture
+{
+public:
+    explicit ImageTexture(std::shared_ptr<TextureFile> file) : file(std::move(file)) {}
+
+    // builds (or refreshes) <path>.rtx next to the PPM and maps it
+    static std::shared_ptr<ImageTexture> load(const std::string& ppmPath)
+    {
+        namespace fs = std::filesystem;
+        std::string cachePath = ppmPath + ".rtx";
+        if (!fs::exists(cachePath) || fs::last_write_time(cachePath) < fs::last_write_time(ppmPath))
+            buildTextureCache(ppmPath, cachePath);
+        return std::make_shared<ImageTexture>(std::make_shared<TextureFile>(cachePath));
+    }
+
+    Vec3 value(float u, float v, const Vec3& p) const override
+    {
+        return lookup(u, v, 0);
+    }
+
+    void hash(Hasher& h) const override
+    {
+        Texture::hash(h);
+        file->hash(h);
+    }
+
+    // footprint is the width of the ray footprint in uv units; picks and blends
+    // the two mip levels whose texels are closest to that size
+    Vec3 lookup(float u, float v, float footprint) const
+    {
+        auto& base = file->level(0);
+        float lod = footprint > 0 ? std::log2(footprint * std::max(base.width, base.height)) : 0.0f;
+        lod = std::min(std::max(lod, 0.0f), float(file->levels() - 1));
+        int l0 = int(lod);
+        float frac = lod - l0;
+        Vec3 col = bilinear(l0, u, v);
+        if (frac > 0 && l0 + 1 < file->levels())
+            col = (1 - frac) * col + frac * bilinear(l0 + 1, u, v);
+        return col;
+    }
+
+private:
+    Vec3 bilinear(int l, float u, float v) const
+    {
+        auto& info = file->level(l);
+        float x = (u - std::floor(u)) * info.width - 0.5f;
+        float y = (v - std::floor(v)) * info.height - 0.5f;
+        int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+        float fx = x - x0, fy = y - y0;
+        return (1 - fy) * ((1 - fx) * texel(l, x0, y0) + fx * texel(l, x0 + 1, y0))
+            + fy * ((1 - fx) * texel(l, x0, y0 + 1) + fx * texel(l, x0 + 1, y0 + 1));
+    }
+
+    // repeat addressing
+    Vec3 texel(int l, int x, int y) const
+    {
+        auto& info = file->level(l);
+        uint32_t ux = uint32_t((x % int(info.width) + int(info.width)) % int(info.width));
+        uint32_t uy = uint32_t((y % int(info.height) + int(info.height)) % int(info.height));
+        uint32_t tx = ux / TextureTileSize, ty = uy / TextureTileSize;
+        return tile(l, tx, ty).texels[(uy % TextureTileSize) * TextureTileSize + ux % TextureTileSize];
+    }
+
+    // small direct-mapped per-thread cache in front of TextureCache; it holds
+    // references, so a tile evicted globally stays valid while a thread uses it
+    const TextureTile& tile(int l, uint32_t tx, uint32_t ty) const
+    {
+        struct Entry
+        {
+            uint64_t key = ~uint64_t(0);
+            std::shared_ptr<const TextureTile> tile;
+        };
+        thread_local std::array<Entry, 64> entries;
+
+        uint64_t k = TextureCache::key(file->id, l, tx, ty);
+        auto& entry = entries[(k ^ (k >> 20) ^ (k >> 40)) % entries.size()];
+        if (entry.key != k) {
+            entry.tile = TextureCache::instance().get(*file, l, tx, ty);
+            entry.key = k;
+        }
+        return *entry.tile;
+    }
+
+    std::shared_ptr<TextureFile> file;
+};
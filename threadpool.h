@@ -2,6 +2,7 @@
 #include <queue>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 
 class ThreadPool
@@ -20,21 +21,60 @@ public:
         {
             std::lock_guard<std::mutex> lock(mutex);
             while (!tasks.empty()) tasks.pop();
+            closing = true;
         }
+        wakeup.notify_all();
         for (auto& t : threads)t.join();
         threads.clear();
         counter = 0;
     }
 
-    void start(size_t thread_num)
+    // persistent workers wait for more tasks when the queue runs dry instead
+    // of exiting, until close() is called
+    void start(size_t thread_num, bool persistent = false)
     {
-        while (thread_num--) threads.emplace_back([this]() {worker(); });
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->persistent = persistent;
+            closing = false;
+        }
+        while (thread_num--) threads.emplace_back([this, index = threads.size()]() {
+            if (workerInit) workerInit(index);
+            worker();
+        });
+    }
+
+    // runs on each worker thread before it takes tasks, e.g. to pin it to a core
+    void onWorkerStart(std::function<void(size_t worker)> init)
+    {
+        workerInit = std::move(init);
+    }
+
+    // lets persistent workers finish the queue and exit, then joins them
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        wakeup.notify_all();
+        join();
+    }
+
+    // waits until the workers have drained the queue and exited
+    void join()
+    {
+        for (auto& t : threads) t.join();
+        threads.clear();
     }
 
     void addTask(std::function<void()> tsk)
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        tasks.push(tsk);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push(tsk);
+        }
+        wakeup.notify_one();
     }
 
     size_t getCounter() const noexcept { return counter; }
@@ -55,7 +95,9 @@ private:
         for (;;) {
             std::function<void()> tsk;
             {
-                std::lock_guard<std::mutex> lock(mutex);
+                std::unique_lock<std::mutex> lock(mutex);
+                if (persistent)
+                    wakeup.wait(lock, [this]() { return !tasks.empty() || closing; });
                 if (tasks.empty()) return;
                 tsk = tasks.front();
                 tasks.pop();
@@ -67,5 +109,8 @@ private:
     std::queue<std::function<void()>> tasks;
     std::vector<std::thread> threads;
     std::mutex mutex;
+    std::condition_variable wakeup;
+    std::function<void(size_t)> workerInit;
+    bool persistent = false, closing = false;
     std::size_t counter = 0;
 };
@@ -0,0 +1,302 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "vec3.h"
+#include "camera.h"
+#include "film.h"
+#include "hash.h"
+#include "objects.h"
+#include "renderer.h"
+
+// Render results kept on disk, addressed by what they were rendered from.
+//
+// A render's key hashes the scene's contents, the camera, the frame size and
+// the sampler seed; a tile's key adds its pixel range. The file for samples
+// [0, spp) of a tile is named after the tile key and spp, and holds the
+// tile's film sums (colour, luminance squared, sample counts and features)
+// as floats. Samples are seeded per pixel and sample index (seed_sample), so
+// a cached tile is exactly what rendering it again would give: a repeated
+// request is assembled from files, and one asking for more samples loads the
+// most that are cached and renders only the rest.
+//
+// The directory is bounded in bytes; the least recently used files go first.
+// Bump TileCacheVersion when the integrator or a material changes what a
+// sample returns, since neither shows up in the keys.
+
+constexpr uint32_t TileCacheVersion = 2;
+
+// what every pixel of a render depends on besides its position and samples
+inline uint64_t renderKey(uint64_t sceneHash, const Camera& camera, unsigned seed, size_t width, size_t height,
+    bool lights)
+{
+    return Hasher().add(uint64_t(TileCacheVersion)).add(sceneHash)
+        .add(camera.lookfrom).add(camera.lookat).add(camera.vup)
+        .add(camera.vfov).add(camera.aspect).add(camera.aperture).add(camera.focus_dist)
+        .add(uint64_t(seed)).add(uint64_t(width)).add(uint64_t(height)).add(uint64_t(lights))
+        .value();
+}
+
+inline uint64_t tileKey(uint64_t renderKey, int i_low, int i_high, int j_low, int j_high)
+{
+    return Hasher().add(renderKey).add(uint64_t(i_low)).add(uint64_t(i_high))
+        .add(uint64_t(j_low)).add(uint64_t(j_high)).value();
+}
+
+struct TileFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t width, height;
+    uint32_t spp;
+    uint32_t reserved;
+};
+
+class TileCache
+{
+public:
+    // every pixel: colour sum, luminance squared sum, sample count, albedo, normal and depth sums
+    static constexpr size_t FloatsPerPixel = 12;
+
+    TileCache(std::string dir, size_t capacityBytes) : dir(std::move(dir)), capacity(capacityBytes)
+    {
+        namespace fs = std::filesystem;
+        fs::create_directories(this->dir);
+        // oldest first, so the newest end up at the front
+        std::vector<std::pair<fs::file_time_type, Entry>> found;
+        for (auto& file : fs::directory_iterator(this->dir)) {
+            Entry entry;
+            if (file.is_regular_file() && parseName(file.path().filename().string(), entry)) {
+                entry.bytes = file.file_size();
+                found.emplace_back(file.last_write_time(), entry);
+            }
+        }
+        std::sort(found.begin(), found.end(), [](auto& a, auto& b) { return a.first < b.first; });
+        for (auto& [time, entry] : found)
+            insert(entry);
+        std::lock_guard<std::mutex> lock(mutex);
+        evict();
+    }
+
+    // Loads the cached tile with the most samples, at most maxSpp, into the
+    // tile's pixels of a clear film. Returns its sample count, 0 if none.
+    int load(uint64_t key, int maxSpp, Film& film, int i_low, int i_high, int j_low, int j_high)
+    {
+        for (;;) {
+            int spp;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = index.find(key);
+                if (it == index.end()) return 0;
+                auto best = it->second.upper_bound(maxSpp);
+                if (best == it->second.begin()) return 0;
+                --best;
+                spp = best->first;
+                lru.splice(lru.begin(), lru, best->second);
+            }
+            // another thread may evict the file meanwhile; then try the next best
+            if (read(key, spp, film, i_low, i_high, j_low, j_high)) {
+                std::error_code ignored;
+                std::filesystem::last_write_time(path(key, spp), std::filesystem::file_time_type::clock::now(), ignored);
+                return spp;
+            }
+            remove(key, spp);
+        }
+    }
+
+    // stores samples [0, spp) of the tile, as the film has them; throws if the
+    // file can't be written
+    void store(uint64_t key, int spp, const Film& film, int i_low, int i_high, int j_low, int j_high)
+    {
+        size_t w = size_t(i_high - i_low), h = size_t(j_high - j_low);
+        std::vector<float> data(w * h * FloatsPerPixel);
+        float* out = data.data();
+        for (int j = j_low; j < j_high; j++) {
+            for (int i = i_low; i < i_high; i++) {
+                size_t idx = size_t(j) * film.width + i;
+                float samples;
+                static_assert(sizeof(samples) == sizeof(film.samples[idx]), "sample counts are stored as their bits");
+                std::memcpy(&samples, &film.samples[idx], sizeof(samples));
+                for (float v : { film.sum[idx][0], film.sum[idx][1], film.sum[idx][2], film.sumLumSq[idx], samples,
+                    film.albedoSum[idx][0], film.albedoSum[idx][1], film.albedoSum[idx][2],
+                    film.normalSum[idx][0], film.normalSum[idx][1], film.normalSum[idx][2], film.depthSum[idx] })
+                    *out++ = v;
+            }
+        }
+
+        // written aside and renamed, so readers never see half a tile
+        std::string final = path(key, spp), temp = final + ".tmp" + std::to_string(nextTemp++);
+        {
+            std::ofstream file(temp, std::ios::binary);
+            TileFileHeader header{ { 'R', 'T', 'T', 'L' }, TileCacheVersion, key, uint32_t(w), uint32_t(h), uint32_t(spp), 0 };
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float));
+            if (!file) {
+                file.close();
+                std::remove(temp.c_str());
+                throw std::runtime_error("cannot write " + temp);
+            }
+        }
+        remove(key, spp);
+        std::error_code error;
+        std::filesystem::rename(temp, final, error);
+        if (error) {
+            std::remove(temp.c_str());
+            throw std::runtime_error("cannot write " + final);
+        }
+        insert(Entry{ key, spp, sizeof(TileFileHeader) + data.size() * sizeof(float) });
+        std::lock_guard<std::mutex> lock(mutex);
+        evict();
+    }
+
+    size_t bytes() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+    // stores renderCachedTile() gave up on
+    std::atomic<size_t> failedStores{ 0 };
+
+private:
+    struct Entry
+    {
+        uint64_t key = 0;
+        int spp = 0;
+        size_t bytes = 0;
+    };
+
+    std::string path(uint64_t key, int spp) const
+    {
+        char name[48];
+        std::snprintf(name, sizeof(name), "%016llx-%d.tile", static_cast<unsigned long long>(key), spp);
+        return (std::filesystem::path(dir) / name).string();
+    }
+
+    static bool parseName(const std::string& name, Entry& entry)
+    {
+        unsigned long long key;
+        int spp, length = 0;
+        if (std::sscanf(name.c_str(), "%16llx-%d.tile%n", &key, &spp, &length) != 2
+            || length != int(name.size()) || spp <= 0)
+            return false;
+        entry.key = key;
+        entry.spp = spp;
+        return true;
+    }
+
+    bool read(uint64_t key, int spp, Film& film, int i_low, int i_high, int j_low, int j_high) const
+    {
+        size_t w = size_t(i_high - i_low), h = size_t(j_high - j_low);
+        std::ifstream file(path(key, spp), std::ios::binary);
+        TileFileHeader header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!file || std::memcmp(header.magic, "RTTL", 4) != 0 || header.version != TileCacheVersion
+            || header.key != key || header.width != w || header.height != h || header.spp != uint32_t(spp))
+            return false;
+        std::vector<float> data(w * h * FloatsPerPixel);
+        file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float));
+        if (!file) return false;
+
+        const float* in = data.data();
+        for (int j = j_low; j < j_high; j++) {
+            for (int i = i_low; i < i_high; i++) {
+                size_t idx = size_t(j) * film.width + i;
+                film.sum[idx] = Vec3(in[0], in[1], in[2]);
+                film.sumLumSq[idx] = in[3];
+                std::memcpy(&film.samples[idx], &in[4], sizeof(float));
+                film.albedoSum[idx] = Vec3(in[5], in[6], in[7]);
+                film.normalSum[idx] = Vec3(in[8], in[9], in[10]);
+                film.depthSum[idx] = in[11];
+                in += FloatsPerPixel;
+            }
+        }
+        return true;
+    }
+
+    void insert(const Entry& entry)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        lru.push_front(entry);
+        index[entry.key][entry.spp] = lru.begin();
+        used += entry.bytes;
+    }
+
+    // forgets an entry and deletes its file
+    void remove(uint64_t key, int spp)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end()) return;
+        auto entry = it->second.find(spp);
+        if (entry == it->second.end()) return;
+        erase(it, entry);
+    }
+
+    using Lru = std::list<Entry>;
+    using Index = std::unordered_map<uint64_t, std::map<int, Lru::iterator>>;
+
+    // with the mutex held
+    void erase(Index::iterator tile, std::map<int, Lru::iterator>::iterator entry)
+    {
+        std::error_code ignored;
+        std::filesystem::remove(path(tile->first, entry->first), ignored);
+        used -= entry->second->bytes;
+        lru.erase(entry->second);
+        tile->second.erase(entry);
+        if (tile->second.empty())
+            index.erase(tile);
+    }
+
+    // with the mutex held
+    void evict()
+    {
+        while (used > capacity && !lru.empty()) {
+            auto tile = index.find(lru.back().key);
+            erase(tile, tile->second.find(lru.back().spp));
+        }
+    }
+
+    std::string dir;
+    size_t capacity;
+    mutable std::mutex mutex;
+    Lru lru; // most recently used first
+    Index index;
+    size_t used = 0;
+    std::atomic<unsigned> nextTemp{ 0 };
+};
+
+// Fills a tile of a clear film with samples [0, spp) of the render `key`:
+// the cached part is loaded, the rest rendered with per-sample seeds and the
+// whole stored back. Returns how many samples per pixel were rendered. A tile
+// that can't be stored (disk full, directory gone) is still in the film, so
+// it is only reported, once per cache, and rendered again next time.
+inline int renderCachedTile(TileCache& cache, uint64_t key, Film& film, const Camera& camera, const Object& world,
+    unsigned seed, int spp, int i_low, int i_high, int j_low, int j_high, const LightBVH* lights = nullptr)
+{
+    uint64_t tile = tileKey(key, i_low, i_high, j_low, j_high);
+    int cached = cache.load(tile, spp, film, i_low, i_high, j_low, j_high);
+    if (cached == spp) return 0;
+    accumulateTileSeeded(film, camera, world, seed, cached, spp - cached, i_low, i_high, j_low, j_high, lights);
+    try {
+        cache.store(tile, spp, film, i_low, i_high, j_low, j_high);
+    }
+    catch (const std::exception& e) {
+        if (cache.failedStores++ == 0)
+            std::cerr << "Tile cache: " << e.what() << ", carrying on without storing tiles that fail" << std::endl;
+    }
+    return spp - cached;
+}
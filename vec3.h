@@ -1,134 +1,146 @@
 #pragma once
-
-class Vec3 {
+#include <cmath>
+#include <iostream>
+#include "vec3_scalar.h"
+
+// Vec3 keeps x, y, z in one SSE register; the fourth lane is padding and is
+// never read by the horizontal operations (dot, length, min/max_component).
+// Build with RAYTRACER_NO_SIMD, or for a target without SSE2, to fall back to
+// the scalar ScalarVec3 from vec3_scalar.h. Both have the same interface.
+#if !defined(RAYTRACER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RAYTRACER_SIMD 1
+#include <immintrin.h>
+
+class alignas(16) Vec3 {
 public:
-    Vec3() { e[0] = e[1] = e[2] = 0; }
-    Vec3(float e0, float e1, float e2) { e[0] = e0; e[1] = e1; e[2] = e2; }
-    inline float x() const { return e[0]; }
-    inline float y() const { return e[1]; }
-    inline float z() const { return e[2]; }
-    inline float r() const { return e[0]; }
-    inline float g() const { return e[1]; }
-    inline float b() const { return e[2]; }
+    Vec3() : m(_mm_setzero_ps()) {}
+    Vec3(float e0, float e1, float e2) : m(_mm_set_ps(0.0f, e2, e1, e0)) {}
+    explicit Vec3(__m128 m) : m(m) {}
+    inline float x() const { return _mm_cvtss_f32(m); }
+    inline float y() const { return _mm_cvtss_f32(_mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1))); }
+    inline float z() const { return _mm_cvtss_f32(_mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2))); }
+    inline float r() const { return x(); }
+    inline float g() const { return y(); }
+    inline float b() const { return z(); }
 
     inline const Vec3& operator+() const { return *this; }
-    inline Vec3 operator-() const { return Vec3(-e[0], -e[1], -e[2]); }
-    inline float operator[](int i) const { return e[i]; }
-    inline float& operator[](int i) { return e[i]; }
-
-    inline Vec3& operator+=(const Vec3& v2);
-    inline Vec3& operator-=(const Vec3& v2);
-    inline Vec3& operator*=(const Vec3& v2);
-    inline Vec3& operator/=(const Vec3& v2);
-    inline Vec3& operator*=(const float t);
-    inline Vec3& operator/=(const float t);
-
-    inline float length() const { return sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]); }
-    inline float squared_length() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+    inline Vec3 operator-() const { return Vec3(_mm_sub_ps(_mm_setzero_ps(), m)); }
+    inline float operator[](int i) const { return reinterpret_cast<const float*>(&m)[i]; }
+    inline float& operator[](int i) { return reinterpret_cast<float*>(&m)[i]; }
+
+    inline Vec3& operator+=(const Vec3& v2) { m = _mm_add_ps(m, v2.m); return *this; }
+    inline Vec3& operator-=(const Vec3& v2) { m = _mm_sub_ps(m, v2.m); return *this; }
+    inline Vec3& operator*=(const Vec3& v2) { m = _mm_mul_ps(m, v2.m); return *this; }
+    inline Vec3& operator/=(const Vec3& v2) { m = _mm_div_ps(m, v2.m); return *this; }
+    inline Vec3& operator*=(const float t) { m = _mm_mul_ps(m, _mm_set1_ps(t)); return *this; }
+    inline Vec3& operator/=(const float t) { m = _mm_mul_ps(m, _mm_set1_ps(1.0f / t)); return *this; }
+
+    inline float length() const;
+    inline float squared_length() const;
     inline void make_unit_vector();
 
-    float e[3];
+    __m128 m;
 };
 
+// x + y + z, broadcast to the low lane
+inline __m128 hsum3(__m128 v) {
+    __m128 y = _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_movehl_ps(v, v);
+    return _mm_add_ss(_mm_add_ss(v, y), z);
+}
+
 inline std::istream& operator>>(std::istream& is, Vec3& t) {
-    is >> t.e[0] >> t.e[1] >> t.e[2];
+    float e0, e1, e2;
+    is >> e0 >> e1 >> e2;
+    t = Vec3(e0, e1, e2);
     return is;
 }
 
 inline std::ostream& operator<<(std::ostream& os, const Vec3& t) {
-    os << t.e[0] << " " << t.e[1] << " " << t.e[2];
+    os << t.x() << " " << t.y() << " " << t.z();
     return os;
 }
 
-inline void Vec3::make_unit_vector() {
-    float k = 1.0f / sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
-    e[0] *= k; e[1] *= k; e[2] *= k;
-}
-
-inline Vec3 operator+(const Vec3& v1, const Vec3& v2) {
-    return Vec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]);
-}
-
-inline Vec3 operator-(const Vec3& v1, const Vec3& v2) {
-    return Vec3(v1.e[0] - v2.e[0], v1.e[1] - v2.e[1], v1.e[2] - v2.e[2]);
-}
-
-inline Vec3 operator*(const Vec3& v1, const Vec3& v2) {
-    return Vec3(v1.e[0] * v2.e[0], v1.e[1] * v2.e[1], v1.e[2] * v2.e[2]);
-}
+inline Vec3 operator+(const Vec3& v1, const Vec3& v2) { return Vec3(_mm_add_ps(v1.m, v2.m)); }
+inline Vec3 operator-(const Vec3& v1, const Vec3& v2) { return Vec3(_mm_sub_ps(v1.m, v2.m)); }
+inline Vec3 operator*(const Vec3& v1, const Vec3& v2) { return Vec3(_mm_mul_ps(v1.m, v2.m)); }
+inline Vec3 operator*(float t, const Vec3& v) { return Vec3(_mm_mul_ps(_mm_set1_ps(t), v.m)); }
+inline Vec3 operator*(const Vec3& v, float t) { return Vec3(_mm_mul_ps(v.m, _mm_set1_ps(t))); }
+inline Vec3 operator/(const Vec3& v1, const Vec3& v2) { return Vec3(_mm_div_ps(v1.m, v2.m)); }
+inline Vec3 operator/(const Vec3& v, float t) { return Vec3(_mm_div_ps(v.m, _mm_set1_ps(t))); }
 
-inline Vec3 operator*(float t, const Vec3& v) {
-    return Vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+inline float dot(const Vec3& v1, const Vec3& v2) {
+    return _mm_cvtss_f32(hsum3(_mm_mul_ps(v1.m, v2.m)));
 }
 
-inline Vec3 operator*(const Vec3& v, float t) {
-    return Vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+inline Vec3 cross(const Vec3& v1, const Vec3& v2) {
+    // a * b.yzx - a.yzx * b is the cross product in zxy order, which saves
+    // two shuffles over the textbook form
+    __m128 a_yzx = _mm_shuffle_ps(v1.m, v1.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(v2.m, v2.m, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(v1.m, b_yzx), _mm_mul_ps(a_yzx, v2.m));
+    return Vec3(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
 }
 
-inline Vec3 operator/(const Vec3& v1, const Vec3& v2) {
-    return Vec3(v1.e[0] / v2.e[0], v1.e[1] / v2.e[1], v1.e[2] / v2.e[2]);
-}
+inline float Vec3::squared_length() const { return dot(*this, *this); }
 
-inline Vec3 operator/(Vec3 v, float t) {
-    return Vec3(v.e[0] / t, v.e[1] / t, v.e[2] / t);
+inline float Vec3::length() const {
+    return _mm_cvtss_f32(_mm_sqrt_ss(hsum3(_mm_mul_ps(m, m))));
 }
 
-inline float dot(const Vec3& v1, const Vec3& v2) {
-    return v1.e[0] * v2.e[0]
-        + v1.e[1] * v2.e[1]
-        + v1.e[2] * v2.e[2];
+// 1 / sqrt(x) from the hardware estimate plus one Newton step (~23 bits)
+inline __m128 rsqrt_nr(__m128 x) {
+    __m128 r = _mm_rsqrt_ps(x);
+    __m128 half_x_rr = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), x), _mm_mul_ps(r, r));
+    return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), half_x_rr));
 }
 
-inline Vec3 cross(const Vec3& v1, const Vec3& v2) {
-    return Vec3(v1.e[1] * v2.e[2] - v1.e[2] * v2.e[1],
-        v1.e[2] * v2.e[0] - v1.e[0] * v2.e[2],
-        v1.e[0] * v2.e[1] - v1.e[1] * v2.e[0]);
+inline void Vec3::make_unit_vector() {
+    __m128 l2 = hsum3(_mm_mul_ps(m, m));
+    m = _mm_mul_ps(m, rsqrt_nr(_mm_shuffle_ps(l2, l2, 0)));
 }
 
-inline Vec3& Vec3::operator+=(const Vec3& v) {
-    e[0] += v.e[0];
-    e[1] += v.e[1];
-    e[2] += v.e[2];
-    return *this;
+inline Vec3 unit_vector(Vec3 v) {
+    v.make_unit_vector();
+    return v;
 }
 
-inline Vec3& Vec3::operator-=(const Vec3& v) {
-    e[0] -= v.e[0];
-    e[1] -= v.e[1];
-    e[2] -= v.e[2];
-    return *this;
+// a * b + c
+inline Vec3 fmadd(const Vec3& a, const Vec3& b, const Vec3& c) {
+#if defined(__FMA__) || defined(__AVX2__)
+    return Vec3(_mm_fmadd_ps(a.m, b.m, c.m));
+#else
+    return Vec3(_mm_add_ps(_mm_mul_ps(a.m, b.m), c.m));
+#endif
 }
 
-inline Vec3& Vec3::operator*=(const Vec3& v) {
-    e[0] *= v.e[0];
-    e[1] *= v.e[1];
-    e[2] *= v.e[2];
-    return *this;
-}
+inline Vec3 vmin(const Vec3& a, const Vec3& b) { return Vec3(_mm_min_ps(a.m, b.m)); }
+inline Vec3 vmax(const Vec3& a, const Vec3& b) { return Vec3(_mm_max_ps(a.m, b.m)); }
 
-inline Vec3& Vec3::operator*=(const float t) {
-    e[0] *= t;
-    e[1] *= t;
-    e[2] *= t;
-    return *this;
+inline float min_component(const Vec3& v) {
+    __m128 m = _mm_min_ss(v.m, _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_min_ss(m, _mm_movehl_ps(v.m, v.m)));
 }
 
-inline Vec3& Vec3::operator/=(const Vec3& v) {
-    e[0] /= v.e[0];
-    e[1] /= v.e[1];
-    e[2] /= v.e[2];
-    return *this;
+inline float max_component(const Vec3& v) {
+    __m128 m = _mm_max_ss(v.m, _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_max_ss(m, _mm_movehl_ps(v.m, v.m)));
 }
 
-inline Vec3& Vec3::operator/=(const float t) {
-    float k = 1.0f / t;
-
-    e[0] *= k;
-    e[1] *= k;
-    e[2] *= k;
-    return *this;
+// slab test against [lo, hi] with a precomputed 1 / direction, all three
+// axes at once; the interval is narrowed in registers and only the final
+// comparison leaves them
+inline bool hit_slabs(const Vec3& lo, const Vec3& hi, const Vec3& origin,
+    const Vec3& inv_dir, float t_min, float t_max) {
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(lo.m, origin.m), inv_dir.m);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(hi.m, origin.m), inv_dir.m);
+    __m128 near_t = _mm_min_ps(t0, t1), far_t = _mm_max_ps(t0, t1);
+    __m128 n = _mm_max_ss(_mm_max_ss(near_t, _mm_shuffle_ps(near_t, near_t, _MM_SHUFFLE(1, 1, 1, 1))),
+        _mm_movehl_ps(near_t, near_t));
+    __m128 f = _mm_min_ss(_mm_min_ss(far_t, _mm_shuffle_ps(far_t, far_t, _MM_SHUFFLE(1, 1, 1, 1))),
+        _mm_movehl_ps(far_t, far_t));
+    return _mm_comilt_ss(_mm_max_ss(n, _mm_set_ss(t_min)), _mm_min_ss(f, _mm_set_ss(t_max)));
 }
-
-inline Vec3 unit_vector(Vec3 v) {
-    return v / v.length();
-}
\ No newline at end of file
+#else
+using Vec3 = ScalarVec3;
+#endif
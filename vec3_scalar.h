@@ -0,0 +1,175 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+// Plain three-float vector. It is the Vec3 used when SIMD is unavailable or
+// disabled (see vec3.h), and the reference the SIMD kernels are benchmarked
+// against.
+
+class ScalarVec3 {
+public:
+    ScalarVec3() { e[0] = e[1] = e[2] = 0; }
+    ScalarVec3(float e0, float e1, float e2) { e[0] = e0; e[1] = e1; e[2] = e2; }
+    inline float x() const { return e[0]; }
+    inline float y() const { return e[1]; }
+    inline float z() const { return e[2]; }
+    inline float r() const { return e[0]; }
+    inline float g() const { return e[1]; }
+    inline float b() const { return e[2]; }
+
+    inline const ScalarVec3& operator+() const { return *this; }
+    inline ScalarVec3 operator-() const { return ScalarVec3(-e[0], -e[1], -e[2]); }
+    inline float operator[](int i) const { return e[i]; }
+    inline float& operator[](int i) { return e[i]; }
+
+    inline ScalarVec3& operator+=(const ScalarVec3& v2);
+    inline ScalarVec3& operator-=(const ScalarVec3& v2);
+    inline ScalarVec3& operator*=(const ScalarVec3& v2);
+    inline ScalarVec3& operator/=(const ScalarVec3& v2);
+    inline ScalarVec3& operator*=(const float t);
+    inline ScalarVec3& operator/=(const float t);
+
+    inline float length() const { return std::sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]); }
+    inline float squared_length() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+    inline void make_unit_vector();
+
+    float e[3];
+};
+
+inline std::istream& operator>>(std::istream& is, ScalarVec3& t) {
+    is >> t.e[0] >> t.e[1] >> t.e[2];
+    return is;
+}
+
+inline std::ostream& operator<<(std::ostream& os, const ScalarVec3& t) {
+    os << t.e[0] << " " << t.e[1] << " " << t.e[2];
+    return os;
+}
+
+inline void ScalarVec3::make_unit_vector() {
+    float k = 1.0f / std::sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+    e[0] *= k; e[1] *= k; e[2] *= k;
+}
+
+inline ScalarVec3 operator+(const ScalarVec3& v1, const ScalarVec3& v2) {
+    return ScalarVec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]);
+}
+
+inline ScalarVec3 operator-(const ScalarVec3& v1, const ScalarVec3& v2) {
+    return ScalarVec3(v1.e[0] - v2.e[0], v1.e[1] - v2.e[1], v1.e[2] - v2.e[2]);
+}
+
+inline ScalarVec3 operator*(const ScalarVec3& v1, const ScalarVec3& v2) {
+    return ScalarVec3(v1.e[0] * v2.e[0], v1.e[1] * v2.e[1], v1.e[2] * v2.e[2]);
+}
+
+inline ScalarVec3 operator*(float t, const ScalarVec3& v) {
+    return ScalarVec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+}
+
+inline ScalarVec3 operator*(const ScalarVec3& v, float t) {
+    return ScalarVec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+}
+
+inline ScalarVec3 operator/(const ScalarVec3& v1, const ScalarVec3& v2) {
+    return ScalarVec3(v1.e[0] / v2.e[0], v1.e[1] / v2.e[1], v1.e[2] / v2.e[2]);
+}
+
+inline ScalarVec3 operator/(ScalarVec3 v, float t) {
+    return ScalarVec3(v.e[0] / t, v.e[1] / t, v.e[2] / t);
+}
+
+inline float dot(const ScalarVec3& v1, const ScalarVec3& v2) {
+    return v1.e[0] * v2.e[0]
+        + v1.e[1] * v2.e[1]
+        + v1.e[2] * v2.e[2];
+}
+
+inline ScalarVec3 cross(const ScalarVec3& v1, const ScalarVec3& v2) {
+    return ScalarVec3(v1.e[1] * v2.e[2] - v1.e[2] * v2.e[1],
+        v1.e[2] * v2.e[0] - v1.e[0] * v2.e[2],
+        v1.e[0] * v2.e[1] - v1.e[1] * v2.e[0]);
+}
+
+inline ScalarVec3& ScalarVec3::operator+=(const ScalarVec3& v) {
+    e[0] += v.e[0];
+    e[1] += v.e[1];
+    e[2] += v.e[2];
+    return *this;
+}
+
+inline ScalarVec3& ScalarVec3::operator-=(const ScalarVec3& v) {
+    e[0] -= v.e[0];
+    e[1] -= v.e[1];
+    e[2] -= v.e[2];
+    return *this;
+}
+
+inline ScalarVec3& ScalarVec3::operator*=(const ScalarVec3& v) {
+    e[0] *= v.e[0];
+    e[1] *= v.e[1];
+    e[2] *= v.e[2];
+    return *this;
+}
+
+inline ScalarVec3& ScalarVec3::operator*=(const float t) {
+    e[0] *= t;
+    e[1] *= t;
+    e[2] *= t;
+    return *this;
+}
+
+inline ScalarVec3& ScalarVec3::operator/=(const ScalarVec3& v) {
+    e[0] /= v.e[0];
+    e[1] /= v.e[1];
+    e[2] /= v.e[2];
+    return *this;
+}
+
+inline ScalarVec3& ScalarVec3::operator/=(const float t) {
+    float k = 1.0f / t;
+
+    e[0] *= k;
+    e[1] *= k;
+    e[2] *= k;
+    return *this;
+}
+
+inline ScalarVec3 unit_vector(ScalarVec3 v) {
+    return v / v.length();
+}
+
+inline ScalarVec3 fmadd(const ScalarVec3& a, const ScalarVec3& b, const ScalarVec3& c) {
+    return ScalarVec3(a.e[0] * b.e[0] + c.e[0], a.e[1] * b.e[1] + c.e[1], a.e[2] * b.e[2] + c.e[2]);
+}
+
+inline ScalarVec3 vmin(const ScalarVec3& a, const ScalarVec3& b) {
+    return ScalarVec3(std::min(a.e[0], b.e[0]), std::min(a.e[1], b.e[1]), std::min(a.e[2], b.e[2]));
+}
+
+inline ScalarVec3 vmax(const ScalarVec3& a, const ScalarVec3& b) {
+    return ScalarVec3(std::max(a.e[0], b.e[0]), std::max(a.e[1], b.e[1]), std::max(a.e[2], b.e[2]));
+}
+
+inline float min_component(const ScalarVec3& v) {
+    return std::min({ v.e[0], v.e[1], v.e[2] });
+}
+
+inline float max_component(const ScalarVec3& v) {
+    return std::max({ v.e[0], v.e[1], v.e[2] });
+}
+
+// slab test against [lo, hi] with a precomputed 1 / direction
+inline bool hit_slabs(const ScalarVec3& lo, const ScalarVec3& hi, const ScalarVec3& origin,
+    const ScalarVec3& inv_dir, float t_min, float t_max) {
+    for (int a = 0; a < 3; a++) {
+        float t0 = (lo.e[a] - origin.e[a]) * inv_dir.e[a];
+        float t1 = (hi.e[a] - origin.e[a]) * inv_dir.e[a];
+        if (inv_dir.e[a] < 0.0f) std::swap(t0, t1);
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max <= t_min) return false;
+    }
+    return true;
+}
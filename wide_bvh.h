@@ -0,0 +1,355 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "vec3.h"
+#include "ray.h"
+#include "objects.h"
+#include "instrumentation.h"
+
+// Four-wide BVH with quantised child boxes. Each 64-byte node stores its own
+// box as an origin plus a power-of-two step per axis, and the boxes of its
+// up to four children as 8-bit multiples of that step, rounded outwards.
+// Traversal tests all four children at once, handles leaf children straight
+// away nearest first, and pushes inner children so the nearest is visited
+// next. Nodes live in one flat array, primitives in another, ordered so each
+// leaf is a contiguous range.
+struct alignas(64) WideNode
+{
+    static constexpr uint32_t LeafFlag = 0x80000000u;
+
+    float origin[3];
+    int8_t exponent[3];    // step along each axis is 2^exponent
+    uint8_t childCount;
+    uint8_t lo[3][4];      // per axis, per child
+    uint8_t hi[3][4];
+    uint32_t child[4];     // node index, or first primitive | LeafFlag
+    uint8_t primCount[4];  // primitives in a leaf child
+};
+static_assert(sizeof(WideNode) == 64, "WideNode should fill one cache line");
+
+class WideBVH : public Object
+{
+public:
+    static constexpr size_t MaxLeafSize = 4;
+
+    explicit WideBVH(std::vector<std::shared_ptr<Object>> objects)
+    {
+        std::vector<BuildPrim> build;
+        build.reserve(objects.size());
+        for (auto& obj : objects) {
+            AABB box;
+            if (!obj->bounding_box(box))
+                std::cerr << "no bounding box in WideBVH constructor\n";
+            build.push_back(BuildPrim{ box.min(), box.max(), 0.5f * (box.min() + box.max()), obj });
+            sceneFeatures |= obj->features();
+        }
+        if (build.empty()) return;
+        boundsOf(build, 0, build.size(), boxMin, boxMax);
+        buildNode(build, 0, build.size(), 1);
+        owners.reserve(build.size());
+        for (auto& p : build) {
+            prims.push_back(p.object.get());
+            owners.push_back(std::move(p.object));
+        }
+    }
+
+    [[nodiscard]] std::optional<HitInfo> hit(const Ray& r, float t_min, float t_max) const noexcept override
+    {
+        if (nodes.empty()) return {};
+        // each level visited leaves at most three siblings on the stack; trees
+        // too deep for the local array (skewed scenes) use a per-thread one
+        Entry local[LocalStackSize];
+        Entry* stack = local;
+        size_t needed = 3 * size_t(maxDepth) + 1;
+        if (needed > LocalStackSize) {
+            thread_local std::vector<Entry> deepStack;
+            if (deepStack.size() < needed) deepStack.resize(needed);
+            stack = deepStack.data();
+        }
+        int sp = 0;
+        stack[sp++] = Entry{ 0, t_min };
+        std::optional<HitInfo> closest;
+
+        while (sp > 0) {
+            Entry entry = stack[--sp];
+            if (entry.tnear > t_max) continue;
+            INSTRUMENT_COUNT(bvhNodesVisited);
+            const WideNode& node = nodes[entry.node];
+
+            float tnear[4];
+            int mask = intersectChildren(node, r, t_min, t_max, tnear);
+            // hit children nearest first
+            int order[4], hits = 0;
+            for (int c = 0; c < node.childCount; c++) {
+                if (!(mask & (1 << c))) continue;
+                int k = hits++;
+                for (; k > 0 && tnear[order[k - 1]] > tnear[c]; k--) order[k] = order[k - 1];
+                order[k] = c;
+            }
+
+            for (int k = 0; k < hits; k++) {
+                int c = order[k];
+                if (!(node.child[c] & WideNode::LeafFlag) || tnear[c] > t_max) continue;
+                uint32_t first = node.child[c] & ~WideNode::LeafFlag;
+                for (uint32_t p = first; p < first + node.primCount[c]; p++) {
+                    if (auto info = prims[p]->hit(r, t_min, t_max); info) {
+                        t_max = info->t;
+                        closest = info;
+                    }
+                }
+            }
+            for (int k = hits - 1; k >= 0; k--) {
+                int c = order[k];
+                if (!(node.child[c] & WideNode::LeafFlag) && tnear[c] <= t_max)
+                    stack[sp++] = Entry{ node.child[c], tnear[c] };
+            }
+        }
+        return closest;
+    }
+
+    [[nodiscard]] bool bounding_box(AABB& box) const noexcept override {
+        if (nodes.empty()) return false;
+        box = AABB(boxMin, boxMax);
+        return true;
+    }
+
+    [[nodiscard]] SceneFeatures features() const noexcept override { return sceneFeatures; }
+
+    size_t nodeCount() const noexcept { return nodes.size(); }
+
+    // bytes taken by the nodes and the primitive list, not the primitives
+    size_t memoryBytes() const noexcept
+    {
+        return nodes.size() * sizeof(WideNode) + prims.size() * (sizeof(const Object*) + sizeof(std::shared_ptr<Object>));
+    }
+
+private:
+    struct BuildPrim
+    {
+        Vec3 lo, hi, centroid;
+        std::shared_ptr<Object> object;
+    };
+
+    struct Range { size_t begin, end; };
+
+    struct Entry { uint32_t node; float tnear; };
+    static constexpr size_t LocalStackSize = 128;
+
+    static void boundsOf(const std::vector<BuildPrim>& build, size_t begin, size_t end, Vec3& lo, Vec3& hi)
+    {
+        lo = build[begin].lo;
+        hi = build[begin].hi;
+        for (size_t i = begin + 1; i < end; i++) {
+            lo = vmin(lo, build[i].lo);
+            hi = vmax(hi, build[i].hi);
+        }
+    }
+
+    static float area(const Vec3& lo, const Vec3& hi) noexcept
+    {
+        Vec3 d = hi - lo;
+        return d.x() * d.y() + d.y() * d.z() + d.z() * d.x();
+    }
+
+    // binned SAH split along the widest centroid axis, median if that fails
+    static size_t split(std::vector<BuildPrim>& build, size_t begin, size_t end)
+    {
+        constexpr int Bins = 12;
+        Vec3 clo = build[begin].centroid, chi = clo;
+        for (size_t i = begin + 1; i < end; i++) {
+            clo = vmin(clo, build[i].centroid);
+            chi = vmax(chi, build[i].centroid);
+        }
+        Vec3 extent = chi - clo;
+        int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+        size_t mid = (begin + end) / 2;
+        if (extent[axis] <= 0) return mid;
+
+        auto binOf = [&](const BuildPrim& p) {
+            return std::min(Bins - 1, int(Bins * (p.centroid[axis] - clo[axis]) / extent[axis]));
+        };
+        size_t count[Bins] = {};
+        Vec3 lo[Bins], hi[Bins];
+        for (size_t i = begin; i < end; i++) {
+            int b = binOf(build[i]);
+            lo[b] = count[b] ? vmin(lo[b], build[i].lo) : build[i].lo;
+            hi[b] = count[b] ? vmax(hi[b], build[i].hi) : build[i].hi;
+            count[b]++;
+        }
+
+        // cost of splitting after bin b, swept from both sides
+        float leftCost[Bins - 1];
+        size_t n = 0;
+        Vec3 accLo, accHi;
+        for (int b = 0; b < Bins - 1; b++) {
+            if (count[b]) {
+                accLo = n ? vmin(accLo, lo[b]) : lo[b];
+                accHi = n ? vmax(accHi, hi[b]) : hi[b];
+                n += count[b];
+            }
+            leftCost[b] = n ? area(accLo, accHi) * n : 0;
+        }
+        int best = -1;
+        float bestCost = std::numeric_limits<float>::max();
+        n = 0;
+        for (int b = Bins - 1; b > 0; b--) {
+            if (count[b]) {
+                accLo = n ? vmin(accLo, lo[b]) : lo[b];
+                accHi = n ? vmax(accHi, hi[b]) : hi[b];
+                n += count[b];
+            }
+            float cost = leftCost[b - 1] + (n ? area(accLo, accHi) * n : 0);
+            if (n && n < end - begin && cost < bestCost) {
+                bestCost = cost;
+                best = b;
+            }
+        }
+        if (best < 0) {
+            std::nth_element(build.begin() + begin, build.begin() + mid, build.begin() + end,
+                [axis](const BuildPrim& a, const BuildPrim& b) { return a.centroid[axis] < b.centroid[axis]; });
+            return mid;
+        }
+        auto it = std::partition(build.begin() + begin, build.begin() + end,
+            [&](const BuildPrim& p) { return binOf(p) < best; });
+        return size_t(it - build.begin());
+    }
+
+    uint32_t buildNode(std::vector<BuildPrim>& build, size_t begin, size_t end, int depth)
+    {
+        maxDepth = std::max(maxDepth, depth);
+        uint32_t index = uint32_t(nodes.size());
+        nodes.emplace_back();
+
+        // open the largest range until there are four children or only leaves
+        Range ranges[4] = { { begin, end } };
+        int count = 1;
+        while (count < 4) {
+            int widest = -1;
+            for (int c = 0; c < count; c++)
+                if (ranges[c].end - ranges[c].begin > MaxLeafSize
+                    && (widest < 0 || ranges[c].end - ranges[c].begin > ranges[widest].end - ranges[widest].begin))
+                    widest = c;
+            if (widest < 0) break;
+            size_t mid = split(build, ranges[widest].begin, ranges[widest].end);
+            ranges[count++] = Range{ mid, ranges[widest].end };
+            ranges[widest].end = mid;
+        }
+
+        Vec3 nodeLo, nodeHi, childLo[4], childHi[4];
+        for (int c = 0; c < count; c++)
+            boundsOf(build, ranges[c].begin, ranges[c].end, childLo[c], childHi[c]);
+        boundsOf(build, begin, end, nodeLo, nodeHi);
+
+        WideNode node{};
+        node.childCount = uint8_t(count);
+        for (int a = 0; a < 3; a++) {
+            float extent = nodeHi[a] - nodeLo[a];
+            int e = extent > 0 ? int(std::ceil(std::log2(extent / 255.0f))) : -126;
+            e = std::max(-126, std::min(127, e));
+            float step = std::ldexp(1.0f, e);
+            // one step of slack so rounding the origin can't cut off the top
+            while (nodeLo[a] + 255 * step < nodeHi[a] && e < 127) step = std::ldexp(1.0f, ++e);
+            node.origin[a] = nodeLo[a];
+            node.exponent[a] = int8_t(e);
+            for (int c = 0; c < count; c++) {
+                float qlo = std::floor((childLo[c][a] - nodeLo[a]) / step);
+                float qhi = std::ceil((childHi[c][a] - nodeLo[a]) / step);
+                node.lo[a][c] = uint8_t(std::max(0.0f, std::min(255.0f, qlo)));
+                node.hi[a][c] = uint8_t(std::max(0.0f, std::min(255.0f, qhi)));
+            }
+        }
+
+        for (int c = 0; c < count; c++) {
+            size_t n = ranges[c].end - ranges[c].begin;
+            if (n <= MaxLeafSize) {
+                node.child[c] = uint32_t(ranges[c].begin) | WideNode::LeafFlag;
+                node.primCount[c] = uint8_t(n);
+            }
+            else {
+                node.child[c] = buildNode(build, ranges[c].begin, ranges[c].end, depth + 1);
+            }
+        }
+        nodes[index] = node;
+        return index;
+    }
+
+    static float exp2i(int e) noexcept
+    {
+        uint32_t bits = uint32_t(e + 127) << 23;
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+
+    // slab test of all children; returns a bit per child hit, with entry distances in tnear
+    static int intersectChildren(const WideNode& node, const Ray& r, float t_min, float t_max, float tnear[4]) noexcept
+    {
+        const Vec3& o = r.origin();
+        const Vec3& inv = r.inv_direction();
+#ifdef RAYTRACER_SIMD
+        __m128 nearT = _mm_set1_ps(t_min), farT = _mm_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            // t = (origin + q * step - o) / d, dividing last as the scalar
+            // version does: folding 1 / d into the other terms turns a zero
+            // direction component into inf - inf
+            __m128 step = _mm_set1_ps(exp2i(node.exponent[a]));
+            __m128 base = _mm_set1_ps(node.origin[a] - o[a]);
+            __m128 invDir = _mm_set1_ps(inv[a]);
+            __m128 t0 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(unpack(node.lo[a]), step), base), invDir);
+            __m128 t1 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(unpack(node.hi[a]), step), base), invDir);
+            // min/max return their second operand for a NaN (0 * inf when the
+            // ray starts on a slab plane), which keeps the running interval
+            nearT = _mm_max_ps(_mm_min_ps(t0, t1), nearT);
+            farT = _mm_min_ps(_mm_max_ps(t0, t1), farT);
+        }
+        // widen a little so boxes grazed exactly aren't lost to rounding
+        farT = _mm_mul_ps(farT, _mm_set1_ps(1.0000004f));
+        _mm_storeu_ps(tnear, nearT);
+        return _mm_movemask_ps(_mm_cmple_ps(nearT, farT)) & ((1 << node.childCount) - 1);
+#else
+        int mask = 0;
+        for (int c = 0; c < node.childCount; c++) {
+            float nearT = t_min, farT = t_max;
+            for (int a = 0; a < 3; a++) {
+                float step = exp2i(node.exponent[a]);
+                float t0 = (node.origin[a] + node.lo[a][c] * step - o[a]) * inv[a];
+                float t1 = (node.origin[a] + node.hi[a][c] * step - o[a]) * inv[a];
+                nearT = std::max(nearT, std::min(t0, t1));
+                farT = std::min(farT, std::max(t0, t1));
+            }
+            tnear[c] = nearT;
+            if (nearT <= farT * 1.0000004f) mask |= 1 << c;
+        }
+        return mask;
+#endif
+    }
+
+#ifdef RAYTRACER_SIMD
+    // four bytes to four floats, SSE2 only
+    static __m128 unpack(const uint8_t q[4]) noexcept
+    {
+        int32_t packed;
+        std::memcpy(&packed, q, sizeof(packed));
+        __m128i zero = _mm_setzero_si128();
+        __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+    }
+#endif
+
+    std::vector<WideNode> nodes;
+    std::vector<const Object*> prims;
+    std::vector<std::shared_ptr<Object>> owners;
+    Vec3 boxMin, boxMax;
+    SceneFeatures sceneFeatures;
+    int maxDepth = 0; // of inner nodes, the root being 1
+};
+
+inline std::shared_ptr<WideBVH> ObjectGroup::to_wide_bvh() const
+{
+    return std::make_shared<WideBVH>(objects);
+}
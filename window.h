@@ -2,6 +2,7 @@
 #define SDL_MAIN_HANDLED
 #include <SDL2/SDL.h>
 #include <string>
+#include <functional>
 #include <GL/glew.h>
 
 class Window
@@ -13,12 +14,14 @@ public:
 
         window = SDL_CreateWindow(title.data(), SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
             width, height, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
-        ctx = SDL_GL_CreateContext(window);
-        glewExperimental = 1;
+        // context attributes only apply to contexts created after them
         SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
         SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
         SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
-        glewInit();   
+        ctx = SDL_GL_CreateContext(window);
+        SDL_GL_SetSwapInterval(1);
+        glewExperimental = 1;
+        glewInit();
     }
 
     Window(const Window&) = delete;
@@ -29,9 +32,12 @@ public:
         SDL_DestroyWindow(window);
     }
 
-    void mainLoop(std::function<void()> render)
+    // render(forceRedraw) returns whether it drew a new frame; when it didn't,
+    // the loop sleeps until the next event (or a few ms) instead of spinning
+    void mainLoop(std::function<bool(bool)> render)
     {
         bool shouldQuit = false;
+        bool forceRedraw = true;
         while(!shouldQuit)
         {
             SDL_Event e;
@@ -47,15 +53,22 @@ public:
                     case SDL_WINDOWEVENT_SIZE_CHANGED:
                         width = e.window.data1;
                         height = e.window.data2;
+                        forceRedraw = true;
+                        break;
+                    case SDL_WINDOWEVENT_EXPOSED:
+                        forceRedraw = true;
                         break;
                     }
                     break;
                 }
             }
 
-            render();
-
-            SDL_GL_SwapWindow(window);
+            if (render(forceRedraw)) {
+                SDL_GL_SwapWindow(window);
+                forceRedraw = false;
+            }
+            else
+                SDL_WaitEventTimeout(nullptr, 10);
         }
     }
 private: